@@ -0,0 +1,92 @@
+/*
+** mrb_require.h - require
+**
+** See Copyright Notice in mruby.h
+*/
+
+#ifndef MRB_REQUIRE_H
+#define MRB_REQUIRE_H
+
+#include "mruby.h"
+
+MRB_BEGIN_DECL
+
+MRB_API mrb_value mrb_require(mrb_state *mrb, mrb_value filename);
+MRB_API mrb_value mrb_load(mrb_state *mrb, mrb_value filename);
+
+/*
+ * Shared objects stay open after the last state using them is closed, so
+ * the next state can reuse the handle. This dlcloses the ones no live
+ * state uses anymore; call it after mrb_close(). Returns the number closed.
+ */
+MRB_API int mrb_require_dlclose_unused(void);
+
+/* Phases of a require, as timed by the profiler and the statistics. */
+enum mrb_require_phase {
+  MRB_REQUIRE_PHASE_REQUIRE,  /* a whole require */
+  MRB_REQUIRE_PHASE_LOAD,     /* a whole load */
+  MRB_REQUIRE_PHASE_RESOLVE,  /* finding the file in $: */
+  MRB_REQUIRE_PHASE_READ,     /* mapping or inflating the file */
+  MRB_REQUIRE_PHASE_PARSE,    /* parser and code generator */
+  MRB_REQUIRE_PHASE_IREP,     /* reading bytecode */
+  MRB_REQUIRE_PHASE_DLOPEN,
+  MRB_REQUIRE_PHASE_INIT,     /* gem init function */
+  MRB_REQUIRE_PHASE_EXEC,     /* running the top level */
+  MRB_REQUIRE_PHASE_MAX
+};
+
+/* Counters of a state since it was opened; see Require.stats. */
+struct mrb_require_stats {
+  uint64_t requires;          /* require calls */
+  uint64_t loads;             /* load calls */
+  uint64_t already_loaded;    /* requires answered without loading */
+  uint64_t probes;            /* candidate files tried in $: */
+  uint64_t realpath_ok;
+  uint64_t realpath_failed;
+  uint64_t open_ok;
+  uint64_t open_failed;
+  uint64_t source_bytes;      /* Ruby source parsed */
+  uint64_t bytecode_bytes;    /* bytecode read from files and archives */
+  uint64_t shared_objects;    /* shared objects and static gems loaded */
+  uint64_t phase_ns[MRB_REQUIRE_PHASE_MAX];  /* inclusive of nested phases */
+};
+
+MRB_API const struct mrb_require_stats *mrb_require_stats(mrb_state *mrb);
+
+/* How a resolved feature is loaded. */
+enum mrb_require_loader {
+  MRB_REQUIRE_LOADER_RB,       /* Ruby source */
+  MRB_REQUIRE_LOADER_MRB,      /* bytecode */
+  MRB_REQUIRE_LOADER_SO,       /* shared object or static gem */
+  MRB_REQUIRE_LOADER_ARCHIVE   /* member of a $: archive */
+};
+
+/* What a hook is told about the require or load in progress. */
+struct mrb_require_event {
+  const char *feature;         /* name given to require or load */
+  const char *path;            /* resolved path, NULL before resolution */
+  enum mrb_require_loader loader;  /* valid once path is set */
+  mrb_bool require;            /* FALSE for load */
+  uint64_t start_ns;           /* monotonic clock at the start */
+  uint64_t elapsed_ns;         /* since start_ns, when the hook is called */
+  mrb_value exc;               /* the exception, for on_error */
+};
+
+typedef void (*mrb_require_hook)(mrb_state *mrb, const struct mrb_require_event *ev, void *ud);
+
+/*
+ * Installs hooks on a state, replacing earlier ones; any may be NULL.
+ * Requires answered from $" without resolving call none of them. The
+ * exception is raised again after on_error returns.
+ */
+MRB_API void mrb_require_set_hooks(mrb_state *mrb,
+                                   mrb_require_hook before_resolve,
+                                   mrb_require_hook after_resolve,
+                                   mrb_require_hook before_load,
+                                   mrb_require_hook after_load,
+                                   mrb_require_hook on_error,
+                                   void *ud);
+
+MRB_END_DECL
+
+#endif /* MRB_REQUIRE_H */
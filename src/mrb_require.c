@@ -4,35 +4,80 @@
 ** See Copyright Notice in mruby.h
 */
 
+/* for dl_iterate_phdr in glibc's <link.h> */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "mruby.h"
 #include "mruby/data.h"
 #include "mruby/string.h"
 #include "mruby/dump.h"
 #include "mruby/proc.h"
+#ifndef MRB_REQUIRE_NO_COMPILER
 #include "mruby/compile.h"
+#endif
 #include "mruby/variable.h"
 #include "mruby/array.h"
+#include "mruby/hash.h"
 #include "mruby/numeric.h"
 #include "mruby/internal.h"
 #include "mruby/irep.h"
+#include "mruby/throw.h"
+#include "mrb_require.h"
 
 #include "opcode.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <setjmp.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
 #include <setjmp.h>
 #if defined(_MSC_VER) || defined(__MINGW32__)
 #ifndef PATH_MAX
 # define PATH_MAX MAX_PATH
 #endif
 #define strdup(x) _strdup(x)
+#include <process.h>
+#include <io.h>
+#define getpid() _getpid()
 #else
 #include <sys/param.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <dlfcn.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#define USE_DIR_INDEX
+#define USE_MMAP
+#define USE_PTHREAD
+#endif
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <link.h>
+#define USE_DL_ITERATE_PHDR
+#endif
+
+/* mruby 3.3 dropped mrb_state.allocf; allocations cannot be counted there */
+#if !defined(MRUBY_RELEASE_NO) || MRUBY_RELEASE_NO < 30300
+#define USE_ALLOCF_COUNT
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef S_ISDIR
+#define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#endif
+
+#ifdef MRB_REQUIRE_USE_ZLIB
+#include <zlib.h>
 #endif
 
 #ifndef RSTRING_CSTR
@@ -49,6 +94,10 @@ mrb_string_cstr(mrb_state *mrb, mrb_value s)
 #define USE_MRUBY_OLD_BYTE_CODE
 #endif
 
+#ifndef MRB_DUMP_DEBUG_INFO
+# define MRB_DUMP_DEBUG_INFO DUMP_DEBUG_INFO
+#endif
+
 #ifndef MRB_PROC_TARGET_CLASS
 # define MRB_PROC_TARGET_CLASS(p, c) p->target_class = c
 #endif
@@ -97,6 +146,24 @@ realpath(const char *path, char *resolved_path) {
 #define MAXPATHLEN 1024
 #endif
 
+/*
+ * USDT probes of provider mruby_require, for perf and bpftrace: each
+ * <name>__start/<name>__end pair gets the feature and the path (NULL
+ * while unknown). They compile to a nop and cost nothing unattached,
+ * and to nothing at all without <sys/sdt.h> or with MRB_REQUIRE_NO_SDT.
+ * Their arguments are evaluated either way, so pass only pointers that
+ * are already at hand, never a call.
+ */
+#if defined(__has_include) && !defined(MRB_REQUIRE_NO_SDT)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define REQUIRE_PROBE(name, feature, path) DTRACE_PROBE2(mruby_require, name, feature, path)
+# endif
+#endif
+#ifndef REQUIRE_PROBE
+# define REQUIRE_PROBE(name, feature, path) ((void)0)
+#endif
+
 #if 0
 # include <stdarg.h>
 # define debug(s,...) printf("%s:%d " s, __FILE__, __LINE__,__VA_ARGS__)
@@ -147,331 +214,2710 @@ envpath_to_mrb_ary(mrb_state *mrb, const char *name)
 }
 
 
-static mrb_value
-find_file_check(mrb_state *mrb, mrb_value path, mrb_value fname, mrb_value ext)
+/*
+ * A file mapped read-only into memory. Where mmap is not available the
+ * contents are read into a malloc'ed buffer instead.
+ */
+struct mapped_file {
+  void *ptr;
+  size_t size;
+  int mapped;
+};
+
+/*
+ * A file opened by the resolver and handed over to the loader, so it is
+ * opened once and cannot change between the existence check and the load.
+ */
+struct load_target {
+  int fd;             /* -1 once consumed */
+  struct stat sb;
+  const struct require_gem *gem;  /* set for bundle members and static gems */
+  const char *feature;            /* as required, for the probes */
+  int tracked;                    /* fd is recorded in pending_fd, see require_guarded */
+};
+
+static int
+target_open(const char *path, struct load_target *t)
 {
-  FILE *fp;
-  char fpath[MAXPATHLEN];
-  mrb_value filepath = mrb_str_dup(mrb, path);
-#ifdef _WIN32
-  if (RSTRING_PTR(fname)[1] == ':') {
-#else
-  if (RSTRING_PTR(fname)[0] == '/') {
-#endif
-    /* when absolute path */
-    mrb_funcall(mrb, filepath, "replace", 1, fname);
-  } else {
-    mrb_str_cat2(mrb, filepath, "/");
-    mrb_str_buf_append(mrb, filepath, fname);
+  t->fd = open(path, O_RDONLY | O_BINARY);
+  if (t->fd < 0) {
+    return -1;
   }
-
-  if (!mrb_string_p(filepath)) {
-    return mrb_nil_value();
+  if (fstat(t->fd, &t->sb) != 0 || S_ISDIR(t->sb.st_mode)) {
+    close(t->fd);
+    t->fd = -1;
+    return -1;
   }
-  if (mrb_string_p(ext)) {
-    mrb_str_buf_append(mrb, filepath, ext);
+  return 0;
+}
+
+static void
+target_close(struct load_target *t)
+{
+  if (t->fd >= 0) {
+    close(t->fd);
+    t->fd = -1;
   }
-  debug("filepath: %s\n", RSTRING_PTR(filepath));
+}
 
-  if (realpath(RSTRING_CSTR(mrb, filepath), fpath) == NULL) {
-    return mrb_nil_value();
+/* Maps the file of `t` and closes its descriptor. */
+static int
+map_target(struct load_target *t, struct mapped_file *mf)
+{
+  int fd = t->fd;
+  size_t off;
+  long n = 0;
+
+  t->fd = -1;
+  mf->ptr = NULL;
+  mf->size = (size_t)t->sb.st_size;
+  mf->mapped = 0;
+  if (fd < 0) {
+    return -1;
   }
-  debug("fpath: %s\n", fpath);
+  if (mf->size == 0) {
+    close(fd);
+    return 0;
+  }
+#ifdef USE_MMAP
+  mf->ptr = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mf->ptr != MAP_FAILED) {
+    mf->mapped = 1;
+    close(fd);
+    return 0;
+  }
+#endif
+  mf->ptr = malloc(mf->size);
+  if (mf->ptr == NULL) {
+    close(fd);
+    return -1;
+  }
+  /* read may return less than asked for, e.g. on pipes or when interrupted */
+  for (off = 0; off < mf->size; off += (size_t)n) {
+    n = read(fd, (char *)mf->ptr + off, (unsigned)(mf->size - off));
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+  }
+  close(fd);
+  if (n < 0) {
+    free(mf->ptr);
+    mf->ptr = NULL;
+    return -1;
+  }
+  /* shrunk since it was opened: what was read is the file */
+  mf->size = off;
+  return 0;
+}
 
-  fp = fopen(fpath, "r");
-  if (fp == NULL) {
-    return mrb_nil_value();
+static int
+map_file(const char *path, struct mapped_file *mf)
+{
+  struct load_target t;
+
+  if (target_open(path, &t) != 0) {
+    return -1;
   }
-  fclose(fp);
+  return map_target(&t, mf);
+}
 
-  return mrb_str_new_cstr(mrb, fpath);
+static void
+unmap_file(struct mapped_file *mf)
+{
+#ifdef USE_MMAP
+  if (mf->mapped) {
+    munmap(mf->ptr, mf->size);
+  } else
+#endif
+  free(mf->ptr);
+  mf->ptr = NULL;
 }
 
-static mrb_value
-find_file(mrb_state *mrb, mrb_value filename, int comp)
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+static uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
 {
-  const char *ext, *ptr, *tmp;
-  mrb_value exts;
-  int i, j;
+  const unsigned char *p = (const unsigned char *)data;
+  while (len--) {
+    h ^= *p++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
 
-  const char *fname = RSTRING_CSTR(mrb, filename);
-  mrb_value filepath = mrb_nil_value();
-  mrb_value load_path = mrb_obj_dup(mrb, mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$:")));
-  load_path = mrb_check_array_type(mrb, load_path);
+#define REQUIRE_GEM_COMPILED_IN 1
+#define REQUIRE_GEM_BUNDLED     2
+#define REQUIRE_GEM_IN_BUNDLE   3
+#define REQUIRE_GEM_STATIC      4
+
+#define REQUIRE_GEM_LOCAL 1   /* exports only its entry points: RTLD_LOCAL */
+
+/* A gem known at build time; see RequireGemTable in mrbgem.rake. */
+struct require_gem {
+  const char *name;
+  int kind;
+  const char *path;     /* bundled: the shared object built for it,
+                           in bundle: the shared object of all gems */
+  const char *init;     /* bundled: entry point names, NULL if absent */
+  const char *final;
+  const char *irep;
+  void (*static_init)(mrb_state *mrb);   /* static: linked entry points */
+  void (*static_final)(mrb_state *mrb);
+  const uint8_t *static_irep;
+  const char *const *deps;  /* gems to require first, NULL terminated */
+  int flags;
+};
+
+#ifdef MRB_REQUIRE_GEM_TABLE
+#include "mrb_require_gems.h"
+#endif
 
-  if(mrb_nil_p(load_path)) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "invalid $:");
-    return mrb_undef_value();
+static const struct require_gem*
+require_gem_lookup(const char *name, size_t len)
+{
+#ifdef MRB_REQUIRE_GEM_TABLE
+  uint64_t b = fnv1a(FNV_OFFSET_BASIS, name, len) % REQUIRE_GEM_BUCKETS;
+  uint64_t h = fnv1a(FNV_OFFSET_BASIS ^ require_gem_seeds[b], name, len);
+  int i = require_gem_slots[h % REQUIRE_GEM_SLOTS];
+
+  if (i >= 0 && strlen(require_gems[i].name) == len &&
+      memcmp(require_gems[i].name, name, len) == 0) {
+    return &require_gems[i];
   }
+#endif
+  return NULL;
+}
 
-  tmp = ptr = fname;
-  while (tmp) {
-    if ((tmp = strchr(ptr, '/')) || (tmp = strchr(ptr, '\\'))) {
-      ptr = tmp + 1;
+#define ARCHIVE_MAGIC "MRBREQA1"
+#define ARCHIVE_DEFLATE 1
+
+struct archive_member {
+  uint32_t offset;
+  uint32_t size;         /* bytes stored in the archive */
+  uint32_t raw_size;     /* bytes after inflating */
+  uint8_t type;          /* 'r' for ruby source, 'm' for bytecode */
+  uint8_t flags;
+  void *inflated;
+};
+
+/* An archive used as a $: entry, mapped once for the life of the state. */
+struct require_archive {
+  struct mapped_file file;
+  uint32_t count;
+  struct archive_member *members;
+};
+
+struct so_entry;
+struct prof_event;
+struct require_memory;
+
+/*
+ * Per-state bookkeeping kept next to $" and $"_. The hashes live in
+ * instance variables of a hidden data object so the GC sees them.
+ */
+#define REQUIRE_MAX_EXTS 8
+
+struct require_hooks {
+  mrb_require_hook before_resolve;
+  mrb_require_hook after_resolve;
+  mrb_require_hook before_load;
+  mrb_require_hook after_load;
+  mrb_require_hook on_error;
+  void *ud;
+  int any;                       /* set when one of them is */
+};
+
+struct require_state {
+  mrb_int loaded_len;   /* RARRAY_LEN($") when loaded_index was synced */
+  mrb_int load_path_gen; /* bumped whenever $: is seen to change */
+  int dir_index;         /* MRUBY_REQUIRE_DIR_INDEX: answer from dir listings */
+  int prefer_mrb;        /* MRUBY_REQUIRE_PREFER_MRB: .mrb over an older .rb */
+  const char *exts[REQUIRE_MAX_EXTS]; /* MRUBY_REQUIRE_EXTS: probing order */
+  int nexts;
+  char *exts_buf;
+  char *cache_dir;       /* MRUBY_REQUIRE_CACHE_DIR: compiled .rb cache */
+  char *path_cache;      /* MRUBY_REQUIRE_PATH_CACHE: persisted resolutions */
+  int path_cache_dirty;
+  struct require_archive *archives;
+  int narchives;
+  struct mapped_file *mappings;  /* bytecode files read in place */
+  int nmappings;
+  struct so_entry **sos;         /* shared objects in load order */
+  int nsos;
+  char *profile;                 /* MRUBY_REQUIRE_PROFILE: output prefix */
+  struct prof_event *events;
+  int nevents;
+  int capa_events;
+  int prof_top;                  /* innermost open event, -1 if none */
+  struct mrb_require_stats stats;
+  struct require_hooks hooks;    /* mrb_require_set_hooks */
+  struct RObject *reported;      /* last exception passed to on_error */
+  int pending_fd;                /* resolved without a guard, not loaded yet */
+  int memory_on;                 /* MRUBY_REQUIRE_MEMORY: fill Require.memory_report */
+  struct require_memory *memory; /* innermost load being measured */
+  uint64_t alloc_bytes;          /* counted while require_allocf is installed */
+#ifdef USE_ALLOCF_COUNT
+  mrb_allocf allocf;             /* the allocator it forwards to */
+  void *allocf_ud;
+#endif
+};
+
+static void profile_free(struct require_state *st);
+
+static void
+require_state_free(mrb_state *mrb, void *p)
+{
+  struct require_state *st = (struct require_state *)p;
+  int i;
+  uint32_t j;
+
+  for (i = 0; i < st->narchives; i++) {
+    for (j = 0; j < st->archives[i].count; j++) {
+      free(st->archives[i].members[j].inflated);
     }
+    free(st->archives[i].members);
+    unmap_file(&st->archives[i].file);
   }
-
-  ext = strrchr(ptr, '.');
-  exts = mrb_ary_new(mrb);
-  if (ext == NULL && comp) {
-    mrb_ary_push(mrb, exts, mrb_str_new_cstr(mrb, ".rb"));
-    mrb_ary_push(mrb, exts, mrb_str_new_cstr(mrb, ".mrb"));
-    mrb_ary_push(mrb, exts, mrb_str_new_cstr(mrb, ".so"));
-  } else {
-    mrb_ary_push(mrb, exts, mrb_nil_value());
+  free(st->archives);
+  for (i = 0; i < st->nmappings; i++) {
+    unmap_file(&st->mappings[i]);
   }
+  free(st->mappings);
+  free(st->sos);
+  mrb_free(mrb, st->cache_dir);
+  mrb_free(mrb, st->path_cache);
+  mrb_free(mrb, st->exts_buf);
+  profile_free(st);
+  free(st->profile);
+  mrb_free(mrb, st);
+}
 
-  /* when a filename start with '.', $: = ['.'] */
-  if (*fname == '.') {
-    load_path = mrb_ary_new(mrb);
-    mrb_ary_push(mrb, load_path, mrb_str_new_cstr(mrb, "."));
-  }
+static const struct mrb_data_type require_state_type = {
+  "RequireState", require_state_free,
+};
 
-  for (i = 0; i < RARRAY_LEN(load_path); i++) {
-    for (j = 0; j < RARRAY_LEN(exts); j++) {
-      filepath = find_file_check(
-        mrb,
-        mrb_ary_entry(load_path, i),
-        filename,
-        mrb_ary_entry(exts, j));
-      if (!mrb_nil_p(filepath)) {
-        return filepath;
+static mrb_value
+require_state_new(mrb_state *mrb)
+{
+  struct require_state *st;
+  struct RData *data;
+  char *env;
+
+  st = (struct require_state *)mrb_calloc(mrb, 1, sizeof(struct require_state));
+  st->prof_top = -1;
+  st->pending_fd = -1;
+  env = getenv("MRUBY_REQUIRE_PROFILE");
+  if (env != NULL && *env != '\0') {
+    st->profile = strdup(env);
+  }
+  env = getenv("MRUBY_REQUIRE_MEMORY");
+  st->memory_on = (env != NULL && *env != '\0');
+  env = getenv("MRUBY_REQUIRE_DIR_INDEX");
+  st->dir_index = (env != NULL && *env != '\0');
+  env = getenv("MRUBY_REQUIRE_PREFER_MRB");
+  st->prefer_mrb = (env != NULL && *env != '\0');
+  env = getenv("MRUBY_REQUIRE_EXTS");
+  if (env != NULL && *env != '\0') {
+    char *ext, *sep;
+
+    st->exts_buf = (char *)mrb_malloc(mrb, strlen(env) + 1);
+    strcpy(st->exts_buf, env);
+    for (ext = st->exts_buf; ext && st->nexts < REQUIRE_MAX_EXTS; ext = sep) {
+      if ((sep = strchr(ext, ',')) != NULL) {
+        *sep++ = '\0';
+      }
+      if (*ext != '\0') {
+        st->exts[st->nexts++] = ext;
       }
     }
   }
+  if (st->nexts == 0) {
+#ifndef MRB_REQUIRE_NO_COMPILER
+    st->exts[st->nexts++] = ".rb";
+#endif
+    st->exts[st->nexts++] = ".mrb";
+    st->exts[st->nexts++] = ".so";
+  }
+#ifndef MRB_REQUIRE_NO_COMPILER
+  env = getenv("MRUBY_REQUIRE_CACHE_DIR");
+  if (env != NULL && *env != '\0') {
+    st->cache_dir = (char *)mrb_malloc(mrb, strlen(env) + 1);
+    strcpy(st->cache_dir, env);
+  }
+#endif
+  env = getenv("MRUBY_REQUIRE_PATH_CACHE");
+  if (env != NULL && *env != '\0') {
+    st->path_cache = (char *)mrb_malloc(mrb, strlen(env) + 1);
+    strcpy(st->path_cache, env);
+  }
+  data = mrb_data_object_alloc(mrb, mrb->object_class, st, &require_state_type);
+  return mrb_obj_value(data);
+}
+
+static mrb_value
+require_state_value(mrb_state *mrb)
+{
+  return mrb_gv_get(mrb, mrb_intern_lit(mrb, "$\"_state"));
+}
+
+static struct mrb_require_stats*
+require_stats(mrb_state *mrb)
+{
+  return &((struct require_state *)DATA_PTR(require_state_value(mrb)))->stats;
+}
+
+/* Returns [archive index, member index] for a virtual archive path, or nil. */
+static mrb_value
+archive_file_ref(mrb_state *mrb, mrb_value filepath)
+{
+  mrb_value files = mrb_iv_get(mrb, require_state_value(mrb), mrb_intern_lit(mrb, "archive_files"));
+
+  if (!mrb_hash_p(files)) {
+    return mrb_nil_value();
+  }
+  return mrb_hash_get(mrb, files, filepath);
+}
 
-  mrb_load_fail(mrb, filename, "cannot load such file");
-  return mrb_nil_value();
+/*
+ * Spans time the phases of a require (enum mrb_require_phase). Spans
+ * nest: a require contains its resolution and the phases of its loader,
+ * and the exec phase contains the requires done by the code it runs.
+ */
+static const char *const phase_names[MRB_REQUIRE_PHASE_MAX] = {
+  "require", "load", "resolve", "read", "parse", "irep", "dlopen", "init", "exec"
+};
+
+struct require_span {
+  int phase;
+  int event;      /* index into the profile, -1 when not recorded */
+  uint64_t start;
+};
+
+/* A span recorded by the profiler. */
+struct prof_event {
+  int phase;
+  int parent;     /* enclosing event, -1 at the top */
+  char *name;     /* feature of require/load spans, else NULL */
+  char *path;     /* resolved path of require/load spans */
+  uint64_t start; /* ns on a monotonic clock */
+  uint64_t end;   /* 0 while open */
+};
+
+static uint64_t
+require_clock(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-#ifdef USE_MRUBY_OLD_BYTE_CODE
+static char*
+prof_strdup(const char *s)
+{
+  return s ? strdup(s) : NULL;
+}
+
+/* Closes the open events down to and including `event`. */
 static void
-replace_stop_with_return(mrb_state *mrb, mrb_irep *irep)
+prof_close(struct require_state *st, int event, uint64_t now)
 {
-  if (irep->iseq[irep->ilen - 1] == MKOP_A(OP_STOP, 0)) {
-    if (irep->flags == MRB_ISEQ_NO_FREE) {
-      mrb_code* iseq = (mrb_code *)mrb_malloc(mrb, (irep->ilen + 1) * sizeof(mrb_code));
-      memcpy(iseq, irep->iseq, irep->ilen * sizeof(mrb_code));
-      irep->iseq = iseq;
-      irep->flags &= ~MRB_ISEQ_NO_FREE;
-    } else {
-      irep->iseq = (mrb_code *)mrb_realloc(mrb, irep->iseq, (irep->ilen + 1) * sizeof(mrb_code));
+  while (st->prof_top >= 0 && st->prof_top >= event) {
+    struct prof_event *ev = &st->events[st->prof_top];
+    if (ev->end == 0) {
+      ev->end = now;
     }
-    irep->iseq[irep->ilen - 1] = MKOP_A(OP_LOADNIL, 0);
-    irep->iseq[irep->ilen] = MKOP_AB(OP_RETURN, 0, OP_R_NORMAL);
-    irep->ilen++;
+    st->prof_top = ev->parent;
   }
 }
-#endif
 
 static void
-load_mrb_file(mrb_state *mrb, mrb_value filepath)
+span_begin(mrb_state *mrb, struct require_span *sp, int phase, const char *name)
 {
-  const char *fpath = RSTRING_CSTR(mrb, filepath);
-  int ai;
-  FILE *fp;
-  mrb_irep *irep;
-
-  fp = fopen(fpath, "rb");
-  if (fp == NULL) {
-    mrb_load_fail(
-      mrb,
-      mrb_str_new_cstr(mrb, fpath),
-      "cannot load such file"
-    );
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct prof_event *ev;
+  uint64_t now;
+
+  now = require_clock();
+  sp->phase = phase;
+  sp->event = -1;
+  sp->start = now;
+  if (st->profile == NULL) {
     return;
   }
 
-  ai = mrb_gc_arena_save(mrb);
-
-  irep = mrb_read_irep_file(mrb, fp);
-  fclose(fp);
-
-  mrb_gc_arena_restore(mrb, ai);
-
-  if (irep) {
-    struct RProc *proc;
+  if (phase == MRB_REQUIRE_PHASE_REQUIRE || phase == MRB_REQUIRE_PHASE_LOAD) {
     /*
-    size_t i;
-    for (i = sirep; i < mrb->irep_len; i++) {
-      mrb->irep[i]->filename = mrb_string_value_ptr(mrb, filepath);
+     * Outside of any load, events still open were left by an exception
+     * that unwound past them: they are not enclosing this one.
+     */
+    mrb_value loading = mrb_gv_get(mrb, mrb_intern_lit(mrb, "$\"_"));
+    if (!mrb_array_p(loading) || RARRAY_LEN(loading) == 0) {
+      prof_close(st, 0, now);
     }
-    */
-
-#ifdef USE_MRUBY_OLD_BYTE_CODE
-    replace_stop_with_return(mrb, irep);
-#endif
-    proc = mrb_proc_new(mrb, irep);
-    MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
-
-    ai = mrb_gc_arena_save(mrb);
-    mrb_yield_with_class(mrb, mrb_obj_value(proc), 0, NULL, mrb_top_self(mrb), mrb->object_class);
-    mrb_gc_arena_restore(mrb, ai);
-  } else if (mrb->exc) {
-    // fail to load
-    longjmp(*(jmp_buf*)mrb->jmp, 1);
   }
+  if (st->nevents == st->capa_events) {
+    int capa = st->capa_events ? st->capa_events * 2 : 64;
+    struct prof_event *events = (struct prof_event *)realloc(st->events, capa * sizeof(struct prof_event));
+    if (events == NULL) {
+      return;
+    }
+    st->events = events;
+    st->capa_events = capa;
+  }
+  ev = &st->events[st->nevents];
+  ev->phase = phase;
+  ev->parent = st->prof_top;
+  ev->name = prof_strdup(name);
+  ev->path = NULL;
+  ev->start = now;
+  ev->end = 0;
+  sp->event = st->prof_top = st->nevents++;
 }
 
 static void
-mrb_load_irep_data(mrb_state* mrb, const uint8_t* data)
+span_path(mrb_state *mrb, struct require_span *sp, mrb_value filepath)
 {
-  int ai = mrb_gc_arena_save(mrb);
-  mrb_irep *irep = mrb_read_irep(mrb,data);
-  mrb_gc_arena_restore(mrb,ai);
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
 
-  if (irep) {
-    int ai;
-    struct RProc *proc;
-
-#ifdef USE_MRUBY_OLD_BYTE_CODE
-    replace_stop_with_return(mrb, irep);
-#endif
-    proc = mrb_proc_new(mrb, irep);
-    MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
-
-    ai = mrb_gc_arena_save(mrb);
-    mrb_yield_with_class(mrb, mrb_obj_value(proc), 0, NULL, mrb_top_self(mrb), mrb->object_class);
-    mrb_gc_arena_restore(mrb, ai);
-  } else if (mrb->exc) {
-    // fail to load
-    longjmp(*(jmp_buf*)mrb->jmp, 1);
+  if (sp->event >= 0 && sp->event < st->nevents && st->events[sp->event].path == NULL) {
+    st->events[sp->event].path = prof_strdup(RSTRING_CSTR(mrb, filepath));
   }
 }
 
 static void
-load_so_file(mrb_state *mrb, mrb_value filepath)
+span_end(mrb_state *mrb, struct require_span *sp)
 {
-  char entry[PATH_MAX] = {0}, *ptr, *top, *tmp;
-  char entry_irep[PATH_MAX] = {0};
-  typedef void (*fn_mrb_gem_init)(mrb_state *mrb);
-  fn_mrb_gem_init fn;
-  void * handle = dlopen(RSTRING_CSTR(mrb, filepath), RTLD_LAZY|RTLD_GLOBAL);
-  const uint8_t* data;
-  if (!handle) {
-    mrb_raise(mrb, E_RUNTIME_ERROR, dlerror());
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  uint64_t now = require_clock();
+
+  st->stats.phase_ns[sp->phase] += now - sp->start;
+  if (sp->event >= 0 && sp->event < st->nevents) {
+    prof_close(st, sp->event, now);
   }
-  dlerror(); // clear last error
+}
 
-  tmp = top = ptr = strdup(RSTRING_CSTR(mrb, filepath));
-  while (tmp) {
-    if ((tmp = strchr(ptr, '/')) || (tmp = strchr(ptr, '\\'))) {
-      ptr = tmp + 1;
+static void
+prof_json_str(FILE *fp, const char *s)
+{
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(fp, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(fp, "\\u%04x", *s);
+    } else {
+      fputc(*s, fp);
     }
   }
+  fputc('"', fp);
+}
 
-  tmp = strrchr(ptr, '.');
-  if (tmp) *tmp = 0;
-  tmp = ptr;
-  while (*tmp) {
-    if (*tmp == '-') *tmp = '_';
-    tmp++;
-  }
-  snprintf(entry, sizeof(entry)-1, "mrb_%s_gem_init", ptr);
-  snprintf(entry_irep, sizeof(entry_irep)-1, "gem_mrblib_irep_%s", ptr);
-  fn = (fn_mrb_gem_init) dlsym(handle, entry);
-  data = (const uint8_t *)dlsym(handle, entry_irep);
-  free(top);
-  if (!fn && !data) {
-      mrb_load_fail(mrb, filepath, "cannot load such file");
-  }
+/* Frame of an event in folded stacks; ';' would split the frame. */
+static void
+prof_folded_frame(FILE *fp, const struct prof_event *ev)
+{
+  const char *s = ev->name ? ev->name : phase_names[ev->phase];
 
-  if (fn != NULL) {
-    int ai = mrb_gc_arena_save(mrb);
-    fn(mrb);
-    mrb_gc_arena_restore(mrb, ai);
+  if (ev->name) {
+    fprintf(fp, "%s ", phase_names[ev->phase]);
   }
-  dlerror(); // clear last error
-
-  if (data != NULL) {
-    mrb_load_irep_data(mrb, data);
+  for (; *s; s++) {
+    fputc(*s == ';' ? '_' : *s, fp);
   }
 }
 
 static void
-unload_so_file(mrb_state *mrb, mrb_value filepath)
+prof_folded_stack(FILE *fp, const struct require_state *st, int i)
 {
-  char entry[PATH_MAX] = {0}, *ptr, *top, *tmp;
-  typedef void (*fn_mrb_gem_final)(mrb_state *mrb);
-  fn_mrb_gem_final fn;
-  void * handle = dlopen(RSTRING_CSTR(mrb, filepath), RTLD_LAZY|RTLD_GLOBAL);
-  if (!handle) {
-    return;
+  if (st->events[i].parent >= 0) {
+    prof_folded_stack(fp, st, st->events[i].parent);
+    fputc(';', fp);
   }
+  prof_folded_frame(fp, &st->events[i]);
+}
 
-  tmp = top = ptr = strdup(RSTRING_CSTR(mrb, filepath));
-  while (tmp) {
+/*
+ * Writes the recorded spans as <profile>.json (Chrome trace events, for
+ * chrome://tracing or Perfetto) and <profile>.folded (for flamegraph.pl,
+ * self time in microseconds).
+ */
+static void
+profile_write(struct require_state *st)
+{
+  char file[MAXPATHLEN];
+  uint64_t now = require_clock(), base;
+  uint64_t *child;
+  FILE *fp;
+  int i;
+
+  if (st->profile == NULL || st->nevents == 0) {
+    return;
+  }
+  prof_close(st, 0, now);
+  base = st->events[0].start;
+
+  snprintf(file, sizeof(file), "%s.json", st->profile);
+  fp = fopen(file, "w");
+  if (fp != NULL) {
+    fputs("{\"traceEvents\":[", fp);
+    for (i = 0; i < st->nevents; i++) {
+      const struct prof_event *ev = &st->events[i];
+      fprintf(fp, "%s\n{\"name\":", i ? "," : "");
+      if (ev->name) {
+        char name[MAXPATHLEN];
+        snprintf(name, sizeof(name), "%s %s", phase_names[ev->phase], ev->name);
+        prof_json_str(fp, name);
+      } else {
+        prof_json_str(fp, phase_names[ev->phase]);
+      }
+      fprintf(fp, ",\"cat\":\"require\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1",
+              (ev->start - base) / 1000.0, (ev->end - ev->start) / 1000.0, (int)getpid());
+      if (ev->path) {
+        fputs(",\"args\":{\"path\":", fp);
+        prof_json_str(fp, ev->path);
+        fputc('}', fp);
+      }
+      fputc('}', fp);
+    }
+    fputs("\n]}\n", fp);
+    fclose(fp);
+  }
+
+  child = (uint64_t *)calloc(st->nevents, sizeof(uint64_t));
+  snprintf(file, sizeof(file), "%s.folded", st->profile);
+  fp = child ? fopen(file, "w") : NULL;
+  if (fp != NULL) {
+    for (i = 0; i < st->nevents; i++) {
+      if (st->events[i].parent >= 0) {
+        child[st->events[i].parent] += st->events[i].end - st->events[i].start;
+      }
+    }
+    for (i = 0; i < st->nevents; i++) {
+      uint64_t dur = st->events[i].end - st->events[i].start;
+      uint64_t self = dur > child[i] ? dur - child[i] : 0;
+      if (self >= 1000) {
+        prof_folded_stack(fp, st, i);
+        fprintf(fp, " %llu\n", (unsigned long long)(self / 1000));
+      }
+    }
+    fclose(fp);
+  }
+  free(child);
+}
+
+static void
+profile_free(struct require_state *st)
+{
+  int i;
+
+  for (i = 0; i < st->nevents; i++) {
+    free(st->events[i].name);
+    free(st->events[i].path);
+  }
+  free(st->events);
+  st->events = NULL;
+  st->nevents = st->capa_events = 0;
+  st->prof_top = -1;
+}
+
+#define PATH_CACHE_HEADER "mruby-require path cache 1"
+
+/*
+ * The persisted resolution cache is a text file of sections, one per
+ * load path fingerprint, each listing `name<TAB>path` lines:
+ *
+ *   mruby-require path cache 1
+ *   [0123456789abcdef]
+ *   foo	/usr/lib/mruby/foo.rb
+ */
+static mrb_value
+path_cache_read(mrb_state *mrb, const char *file)
+{
+  mrb_value sections = mrb_hash_new(mrb);
+  mrb_value section = mrb_nil_value();
+  char line[MAXPATHLEN * 2];
+  FILE *fp;
+  int ai;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    return sections;
+  }
+  if (fgets(line, sizeof(line), fp) == NULL ||
+      strcmp(line, PATH_CACHE_HEADER "\n") != 0) {
+    fclose(fp);
+    return sections;
+  }
+
+  ai = mrb_gc_arena_save(mrb);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *tab, *end = strchr(line, '\n');
+    if (end == NULL) {
+      break;
+    }
+    *end = '\0';
+    if (line[0] == '[' && end > line + 1 && end[-1] == ']') {
+      section = mrb_hash_new(mrb);
+      mrb_hash_set(mrb, sections, mrb_str_new(mrb, line + 1, end - line - 2), section);
+    } else if (mrb_hash_p(section) && (tab = strchr(line, '\t')) != NULL) {
+      mrb_hash_set(mrb, section,
+                   mrb_str_new(mrb, line, tab - line),
+                   mrb_str_new_cstr(mrb, tab + 1));
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  fclose(fp);
+
+  return sections;
+}
+
+/*
+ * Returns the persisted section for this load path, keyed by a hash of
+ * the $: entries and their directory mtimes. Adding or removing a file in
+ * any of them therefore starts a fresh section.
+ */
+static mrb_value
+path_cache_section(mrb_state *mrb, mrb_value load_path)
+{
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
+  mrb_value sections = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "path_cache"));
+  mrb_value used = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "path_cache_used"));
+  mrb_value key, section;
+  uint64_t h = FNV_OFFSET_BASIS;
+  char buf[32];
+  mrb_int i;
+
+  if (!mrb_hash_p(sections)) {
+    sections = path_cache_read(mrb, st->path_cache);
+    used = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "path_cache"), sections);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "path_cache_used"), used);
+  }
+
+  for (i = 0; i < RARRAY_LEN(load_path); i++) {
+    mrb_value dir = mrb_ary_entry(load_path, i);
+    struct stat sb;
+    long long mtime = -1;
+
+    if (mrb_string_p(dir)) {
+      if (stat(RSTRING_CSTR(mrb, dir), &sb) == 0) {
+        mtime = (long long)sb.st_mtime;
+      }
+      h = fnv1a(h, RSTRING_PTR(dir), RSTRING_LEN(dir));
+    }
+    snprintf(buf, sizeof(buf), ":%lld\n", mtime);
+    h = fnv1a(h, buf, strlen(buf));
+  }
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+  key = mrb_str_new_cstr(mrb, buf);
+
+  section = mrb_hash_get(mrb, sections, key);
+  if (!mrb_hash_p(section)) {
+    section = mrb_hash_new(mrb);
+    mrb_hash_set(mrb, sections, key, section);
+  }
+  mrb_hash_set(mrb, used, key, mrb_true_value());
+
+  return section;
+}
+
+/* Rewrites the persisted cache with the sections used by this process. */
+static void
+path_cache_write(mrb_state *mrb)
+{
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
+  mrb_value sections, used, keys;
+  char tmp[MAXPATHLEN];
+  FILE *fp;
+  mrb_int i, j;
+  int ok;
+
+  if (st->path_cache == NULL || !st->path_cache_dirty) {
+    return;
+  }
+  sections = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "path_cache"));
+  used = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "path_cache_used"));
+  if (!mrb_hash_p(sections) || !mrb_hash_p(used)) {
+    return;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", st->path_cache, (int)getpid());
+  fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    return;
+  }
+  ok = fputs(PATH_CACHE_HEADER "\n", fp) >= 0;
+  keys = mrb_hash_keys(mrb, used);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    mrb_value key = mrb_ary_entry(keys, i);
+    mrb_value section = mrb_hash_get(mrb, sections, key);
+    mrb_value names;
+
+    if (!mrb_hash_p(section)) {
+      continue;
+    }
+    fprintf(fp, "[%s]\n", RSTRING_CSTR(mrb, key));
+    names = mrb_hash_keys(mrb, section);
+    for (j = 0; j < RARRAY_LEN(names); j++) {
+      mrb_value name = mrb_ary_entry(names, j);
+      mrb_value path = mrb_hash_get(mrb, section, name);
+
+      /*
+       * misses are not persisted: a new file may show up in a subdirectory.
+       * Archive members are cheap to find again and have no real path.
+       */
+      if (!mrb_string_p(path) || !mrb_nil_p(archive_file_ref(mrb, path)) ||
+          strpbrk(RSTRING_CSTR(mrb, name), "\t\n") ||
+          strchr(RSTRING_CSTR(mrb, path), '\n')) {
+        continue;
+      }
+      fprintf(fp, "%s\t%s\n", RSTRING_CSTR(mrb, name), RSTRING_CSTR(mrb, path));
+    }
+  }
+  ok = !ferror(fp) && ok;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp, st->path_cache) != 0) {
+    remove(tmp);
+  }
+  st->path_cache_dirty = 0;
+}
+
+/*
+ * Compares $: with the copy taken at the last call and bumps the load
+ * path generation when it differs. Entries are compared by content, so
+ * both `$: << dir` and in-place edits of an entry are noticed. All
+ * resolution results belong to one generation and are dropped with it.
+ */
+static mrb_int
+load_path_sync(mrb_state *mrb, mrb_value load_path)
+{
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
+  mrb_value snapshot = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "load_path"));
+  mrb_int i, len = RARRAY_LEN(load_path);
+
+  if (mrb_array_p(snapshot) && RARRAY_LEN(snapshot) == len) {
+    for (i = 0; i < len; i++) {
+      mrb_value a = mrb_ary_entry(load_path, i);
+      mrb_value b = mrb_ary_entry(snapshot, i);
+      if (mrb_string_p(a) ? !mrb_str_equal(mrb, a, b) : !mrb_obj_eq(mrb, a, b)) {
+        break;
+      }
+    }
+    if (i == len) {
+      return st->load_path_gen;
+    }
+  }
+
+  snapshot = mrb_ary_new_capa(mrb, len);
+  for (i = 0; i < len; i++) {
+    mrb_value a = mrb_ary_entry(load_path, i);
+    mrb_ary_push(mrb, snapshot, mrb_string_p(a) ? mrb_str_dup(mrb, a) : a);
+  }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "load_path"), snapshot);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "resolve_cache"),
+             st->path_cache ? path_cache_section(mrb, snapshot) : mrb_nil_value());
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "load_cache"), mrb_nil_value());
+
+  return ++st->load_path_gen;
+}
+
+/*
+ * Resolution cache of the current load path generation: requested name
+ * to absolute path, or false for a name that could not be found.
+ * `require` and `load` try different extensions and get separate caches.
+ */
+static mrb_value
+resolve_cache(mrb_state *mrb, mrb_value load_path, int comp)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_sym name = comp ? mrb_intern_lit(mrb, "resolve_cache") : mrb_intern_lit(mrb, "load_cache");
+  mrb_value cache;
+
+  load_path_sync(mrb, load_path);
+  cache = mrb_iv_get(mrb, self, name);
+  if (!mrb_hash_p(cache)) {
+    cache = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, name, cache);
+  }
+  return cache;
+}
+
+/* The directory `path`/`fname[0,dirlen]` a feature would be found in. */
+static mrb_value
+feature_dir(mrb_state *mrb, mrb_value path, const char *fname, size_t dirlen)
+{
+  mrb_value dir = mrb_str_dup(mrb, path);
+
+  if (dirlen > 0) {
+    mrb_str_cat_lit(mrb, dir, "/");
+    mrb_str_cat(mrb, dir, fname, dirlen - 1);
+  }
+  return dir;
+}
+
+#define DIR_INDEX_NAME "mruby-require.idx"
+#define DIR_INDEX_HEADER "mruby-require index 1"
+
+/*
+ * Returns the index written into `dir` by the mruby-require index rake
+ * task, or nil if there is none. It maps each loadable file name to
+ * true, or for shared objects to their [init, final, irep] entry point
+ * names. Index files are read once per state: they are meant for trees
+ * that do not change after they are built or installed.
+ */
+static mrb_value
+dir_index_file(mrb_state *mrb, mrb_value dir)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_value indexes = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "dir_indexes"));
+  mrb_value file, names = mrb_nil_value();
+  struct mapped_file mf;
+  const char *p, *end;
+  int ai;
+
+  if (!mrb_hash_p(indexes)) {
+    indexes = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "dir_indexes"), indexes);
+  }
+  names = mrb_hash_get(mrb, indexes, dir);
+  if (!mrb_nil_p(names)) {
+    return mrb_hash_p(names) ? names : mrb_nil_value();
+  }
+
+  file = mrb_str_dup(mrb, dir);
+  mrb_str_cat_lit(mrb, file, "/" DIR_INDEX_NAME);
+  if (map_file(RSTRING_CSTR(mrb, file), &mf) == 0) {
+    p = (const char *)mf.ptr;
+    end = p + mf.size;
+    if (mf.size > sizeof(DIR_INDEX_HEADER) - 1 &&
+        memcmp(p, DIR_INDEX_HEADER "\n", sizeof(DIR_INDEX_HEADER)) == 0) {
+      p += sizeof(DIR_INDEX_HEADER);
+      names = mrb_hash_new(mrb);
+      ai = mrb_gc_arena_save(mrb);
+      while (p < end) {
+        /* <name> TAB <rb|mrb|so> [TAB <init> TAB <final> TAB <irep>] */
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        const char *f[5];
+        size_t flen[5];
+        int n = 0;
+
+        if (eol == NULL) {
+          eol = end;
+        }
+        while (n < 5) {
+          const char *tab = (const char *)memchr(p, '\t', eol - p);
+          f[n] = p;
+          flen[n] = (tab ? tab : eol) - p;
+          n++;
+          if (tab == NULL) {
+            break;
+          }
+          p = tab + 1;
+        }
+        if (flen[0] > 0) {
+          mrb_value value = mrb_true_value();
+          if (n == 5 && flen[1] == 2 && memcmp(f[1], "so", 2) == 0) {
+            int i;
+            value = mrb_ary_new_capa(mrb, 3);
+            for (i = 2; i < 5; i++) {
+              int absent = flen[i] == 1 && *f[i] == '-';
+              mrb_ary_push(mrb, value, absent ? mrb_nil_value() : mrb_str_new(mrb, f[i], flen[i]));
+            }
+          }
+          mrb_hash_set(mrb, names, mrb_str_new(mrb, f[0], flen[0]), value);
+        }
+        mrb_gc_arena_restore(mrb, ai);
+        p = eol + 1;
+      }
+    }
+    unmap_file(&mf);
+  }
+  mrb_hash_set(mrb, indexes, dir, mrb_nil_p(names) ? mrb_false_value() : names);
+  return names;
+}
+
+static int
+dir_listing_has(mrb_state *mrb, mrb_value names, const char *base, const char *ext)
+{
+  mrb_value name = mrb_str_new_cstr(mrb, base);
+  mrb_str_cat2(mrb, name, ext);
+  return mrb_hash_key_p(mrb, names, name);
+}
+
+#ifdef USE_DIR_INDEX
+/*
+ * Returns the names of the non-directory entries of `dir` as hash keys,
+ * or nil when that directory does not exist. Listings are read once and
+ * reused until the directory mtime changes. A listing taken within the
+ * same second as the last modification is not trusted, since a later
+ * change in that second would not move the mtime.
+ */
+static mrb_value
+dir_listing(mrb_state *mrb, mrb_value dir)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_value listings = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "dir_listings"));
+  mrb_value entry, names;
+  struct stat sb;
+  struct dirent *de;
+  DIR *dp;
+  int ai;
+
+  if (!mrb_hash_p(listings)) {
+    listings = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "dir_listings"), listings);
+  }
+
+  if (stat(RSTRING_CSTR(mrb, dir), &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+    mrb_hash_delete_key(mrb, listings, dir);
+    return mrb_nil_value();
+  }
+
+  entry = mrb_hash_get(mrb, listings, dir);
+  if (mrb_array_p(entry) &&
+      mrb_fixnum(mrb_ary_entry(entry, 0)) == (mrb_int)sb.st_mtime &&
+      mrb_fixnum(mrb_ary_entry(entry, 1)) > (mrb_int)sb.st_mtime) {
+    return mrb_ary_entry(entry, 2);
+  }
+
+  dp = opendir(RSTRING_CSTR(mrb, dir));
+  if (dp == NULL) {
+    return mrb_nil_value();
+  }
+  names = mrb_hash_new(mrb);
+  ai = mrb_gc_arena_save(mrb);
+  while ((de = readdir(dp)) != NULL) {
+#ifdef DT_DIR
+    if (de->d_type == DT_DIR) {
+      continue;
+    }
+#endif
+    mrb_hash_set(mrb, names, mrb_str_new_cstr(mrb, de->d_name), mrb_true_value());
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  closedir(dp);
+
+  entry = mrb_ary_new_capa(mrb, 3);
+  mrb_ary_push(mrb, entry, mrb_fixnum_value((mrb_int)sb.st_mtime));
+  mrb_ary_push(mrb, entry, mrb_fixnum_value((mrb_int)time(NULL)));
+  mrb_ary_push(mrb, entry, names);
+  mrb_hash_set(mrb, listings, dir, entry);
+
+  return names;
+}
+#endif
+
+static uint32_t
+archive_u32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * Archive format (integers are big endian):
+ *
+ *   "MRBREQA1" count:u32
+ *   count * { name_len:u16 name type:u8 flags:u8 offset:u32 size:u32 raw_size:u32 }
+ *   member data
+ *
+ * Returns [archive index, canonical path, {member name => member index}]
+ * for a $: entry naming an archive, or nil when it is not a usable one.
+ */
+static mrb_value
+archive_open(mrb_state *mrb, mrb_value path)
+{
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
+  mrb_value archives = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "archives"));
+  mrb_value entry, members;
+  struct require_archive ar, *tmp;
+  char fpath[MAXPATHLEN];
+  const uint8_t *p, *end;
+  uint32_t i;
+  int ai;
+
+  if (!mrb_hash_p(archives)) {
+    archives = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "archives"), archives);
+  }
+  entry = mrb_hash_get(mrb, archives, path);
+  if (!mrb_nil_p(entry)) {
+    return mrb_array_p(entry) ? entry : mrb_nil_value();
+  }
+  mrb_hash_set(mrb, archives, path, mrb_false_value());
+
+  if (realpath(RSTRING_CSTR(mrb, path), fpath) == NULL ||
+      map_file(fpath, &ar.file) != 0) {
+    return mrb_nil_value();
+  }
+  p = (const uint8_t *)ar.file.ptr;
+  end = p + ar.file.size;
+  if (ar.file.size < 12 || memcmp(p, ARCHIVE_MAGIC, 8) != 0) {
+    unmap_file(&ar.file);
+    return mrb_nil_value();
+  }
+  ar.count = archive_u32(p + 8);
+  ar.members = (struct archive_member *)calloc(ar.count ? ar.count : 1, sizeof(struct archive_member));
+  if (ar.members == NULL) {
+    unmap_file(&ar.file);
+    return mrb_nil_value();
+  }
+
+  members = mrb_hash_new(mrb);
+  ai = mrb_gc_arena_save(mrb);
+  p += 12;
+  for (i = 0; i < ar.count; i++) {
+    struct archive_member *m = &ar.members[i];
+    uint16_t nlen;
+
+    if (end - p < 2) {
+      break;
+    }
+    nlen = (uint16_t)((p[0] << 8) | p[1]);
+    if (end - p < 2 + nlen + 14) {
+      break;
+    }
+    mrb_hash_set(mrb, members, mrb_str_new(mrb, (const char *)p + 2, nlen), mrb_fixnum_value(i));
+    p += 2 + nlen;
+    m->type = p[0];
+    m->flags = p[1];
+    m->offset = archive_u32(p + 2);
+    m->size = archive_u32(p + 6);
+    m->raw_size = archive_u32(p + 10);
+    p += 14;
+    if (m->offset > ar.file.size || m->size > ar.file.size - m->offset) {
+      break;
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (i < ar.count) {
+    free(ar.members);
+    unmap_file(&ar.file);
+    return mrb_nil_value();
+  }
+
+  tmp = (struct require_archive *)realloc(st->archives, (st->narchives + 1) * sizeof(struct require_archive));
+  if (tmp == NULL) {
+    free(ar.members);
+    unmap_file(&ar.file);
+    return mrb_nil_value();
+  }
+  st->archives = tmp;
+  st->archives[st->narchives] = ar;
+
+  entry = mrb_ary_new_capa(mrb, 3);
+  mrb_ary_push(mrb, entry, mrb_fixnum_value(st->narchives++));
+  mrb_ary_push(mrb, entry, mrb_str_new_cstr(mrb, fpath));
+  mrb_ary_push(mrb, entry, members);
+  mrb_hash_set(mrb, archives, path, entry);
+
+  return entry;
+}
+
+/*
+ * Resolves `fname` + `ext` against an archive $: entry. The result is a
+ * virtual path "<archive>/<member>" that load_file recognizes.
+ */
+static mrb_value
+archive_find(mrb_state *mrb, mrb_value archive, mrb_value fname, const char *ext)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_value files, name, index, filepath, ref;
+
+  name = mrb_str_dup(mrb, fname);
+  mrb_str_cat2(mrb, name, ext);
+  index = mrb_hash_get(mrb, mrb_ary_entry(archive, 2), name);
+  if (mrb_nil_p(index)) {
+    return mrb_nil_value();
+  }
+
+  filepath = mrb_str_dup(mrb, mrb_ary_entry(archive, 1));
+  mrb_str_cat_lit(mrb, filepath, "/");
+  mrb_str_cat_str(mrb, filepath, name);
+
+  files = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "archive_files"));
+  if (!mrb_hash_p(files)) {
+    files = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "archive_files"), files);
+  }
+  ref = mrb_ary_new_capa(mrb, 2);
+  mrb_ary_push(mrb, ref, mrb_ary_entry(archive, 0));
+  mrb_ary_push(mrb, ref, index);
+  mrb_hash_set(mrb, files, filepath, ref);
+
+  return filepath;
+}
+
+static int
+archive_path_p(mrb_value path)
+{
+  return mrb_string_p(path) && RSTRING_LEN(path) > 4 &&
+    memcmp(RSTRING_PTR(path) + RSTRING_LEN(path) - 4, ".mra", 4) == 0;
+}
+
+static mrb_value
+find_file_check(mrb_state *mrb, mrb_value path, mrb_value fname, const char *ext, struct load_target *t)
+{
+  char fpath[MAXPATHLEN];
+  struct mrb_require_stats *stats = require_stats(mrb);
+  mrb_value filepath = mrb_str_dup(mrb, path);
+#ifdef _WIN32
+  if (RSTRING_PTR(fname)[1] == ':') {
+#else
+  if (RSTRING_PTR(fname)[0] == '/') {
+#endif
+    /* when absolute path */
+    mrb_funcall(mrb, filepath, "replace", 1, fname);
+  } else {
+    mrb_str_cat2(mrb, filepath, "/");
+    mrb_str_buf_append(mrb, filepath, fname);
+  }
+
+  if (!mrb_string_p(filepath)) {
+    return mrb_nil_value();
+  }
+  if (*ext) {
+    mrb_str_cat2(mrb, filepath, ext);
+  }
+  debug("filepath: %s\n", RSTRING_PTR(filepath));
+
+  stats->probes++;
+  if (realpath(RSTRING_CSTR(mrb, filepath), fpath) == NULL) {
+    stats->realpath_failed++;
+    return mrb_nil_value();
+  }
+  stats->realpath_ok++;
+  debug("fpath: %s\n", fpath);
+
+  /* left open for the loader */
+  if (target_open(fpath, t) != 0) {
+    stats->open_failed++;
+    return mrb_nil_value();
+  }
+  stats->open_ok++;
+
+  return mrb_str_new_cstr(mrb, fpath);
+}
+
+/*
+ * For a resolved .rb file, the .mrb next to it if that is at least as
+ * new; `t` is switched over to it. The .rb path is what gets cached, so
+ * an edited source takes over again from a stale .mrb.
+ */
+static mrb_value
+newer_mrb(mrb_state *mrb, mrb_value filepath, struct load_target *t)
+{
+  struct load_target mt;
+  mrb_value mrbpath;
+  mrb_int len = RSTRING_LEN(filepath);
+
+  if (len < 3 || memcmp(RSTRING_PTR(filepath) + len - 3, ".rb", 3) != 0) {
+    return filepath;
+  }
+  mrbpath = mrb_str_new(mrb, RSTRING_PTR(filepath), len - 2);
+  mrb_str_cat_lit(mrb, mrbpath, "mrb");
+  if (target_open(RSTRING_CSTR(mrb, mrbpath), &mt) != 0) {
+    return filepath;
+  }
+  if (mt.sb.st_mtime < t->sb.st_mtime) {
+    target_close(&mt);
+    return filepath;
+  }
+  target_close(t);
+  t->fd = mt.fd;
+  t->sb = mt.sb;
+  return mrbpath;
+}
+
+/* Resolves `filename` against $:, returning nil when it cannot be found. */
+static mrb_value
+find_file_path(mrb_state *mrb, mrb_value filename, int comp, struct load_target *t)
+{
+  static const char *no_exts[] = { "" };
+  const char *ext, *ptr, *tmp;
+  const char *const *exts;
+  int i, j, nexts;
+
+  const char *fname = RSTRING_CSTR(mrb, filename);
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  mrb_value filepath = mrb_nil_value();
+  mrb_value cache = mrb_nil_value();
+  mrb_value load_path = mrb_check_array_type(mrb, mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$:")));
+  int cached = 1;  /* answers are taken from and kept in `cache` */
+
+  t->fd = -1;
+  t->gem = NULL;
+  if(mrb_nil_p(load_path)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "invalid $:");
+    return mrb_undef_value();
+  }
+
+  tmp = ptr = fname;
+  while (tmp) {
+    if ((tmp = strchr(ptr, '/')) || (tmp = strchr(ptr, '\\'))) {
+      ptr = tmp + 1;
+    }
+  }
+
+  ext = strrchr(ptr, '.');
+  if (ext == NULL && comp) {
+    const struct require_gem *gem = require_gem_lookup(fname, strlen(fname));
+
+    /* a gem bundled by this build: open its shared object directly */
+    if (gem && gem->kind == REQUIRE_GEM_BUNDLED && target_open(gem->path, t) == 0) {
+      return mrb_str_new_cstr(mrb, gem->path);
+    }
+    /* a member of the bundle, provided as "<bundle>/<gem>" */
+    if (gem && gem->kind == REQUIRE_GEM_IN_BUNDLE) {
+      filepath = mrb_str_new_cstr(mrb, gem->path);
+      mrb_str_cat_lit(mrb, filepath, "/");
+      mrb_str_cat_cstr(mrb, filepath, gem->name);
+      t->gem = gem;
+      return filepath;
+    }
+    /* linked in but not initialized yet, provided under its name */
+    if (gem && gem->kind == REQUIRE_GEM_STATIC) {
+      t->gem = gem;
+      return mrb_str_new_cstr(mrb, gem->name);
+    }
+    exts = st->exts;
+    nexts = st->nexts;
+  } else {
+    exts = no_exts;
+    nexts = 1;
+  }
+
+  /* when a filename start with '.', $: = ['.'] */
+  if (*fname == '.') {
+    load_path = mrb_ary_new(mrb);
+    mrb_ary_push(mrb, load_path, mrb_str_new_cstr(mrb, "."));
+  } else {
+    cache = resolve_cache(mrb, load_path, comp);
+#ifdef USE_DIR_INDEX
+    /*
+     * Listings are checked against the directory mtime on each lookup; a
+     * remembered path or miss would skip that, and miss files deployed
+     * since (including ones that now shadow a later $: entry).
+     */
+    cached = !st->dir_index;
+#endif
+    filepath = cached ? mrb_hash_get(mrb, cache, filename) : mrb_nil_value();
+    if (mrb_string_p(filepath)) {
+      if (!mrb_nil_p(archive_file_ref(mrb, filepath))) {
+        return filepath;
+      }
+      if (target_open(RSTRING_CSTR(mrb, filepath), t) == 0) {
+        st->stats.open_ok++;
+        return st->prefer_mrb ? newer_mrb(mrb, filepath, t) : filepath;
+      }
+      st->stats.open_failed++;
+      /* the file went away since it was resolved: look it up again */
+      mrb_hash_delete_key(mrb, cache, filename);
+      st->path_cache_dirty = 1;
+    } else if (!mrb_nil_p(filepath)) {
+      return mrb_nil_value();
+    }
+  }
+
+  for (i = 0; i < RARRAY_LEN(load_path); i++) {
+    mrb_value names = mrb_nil_value();
+    if (archive_path_p(mrb_ary_entry(load_path, i))) {
+      mrb_value archive = archive_open(mrb, mrb_ary_entry(load_path, i));
+      if (mrb_nil_p(archive) || *fname == '/') {
+        continue;
+      }
+      for (j = 0; j < nexts; j++) {
+        filepath = archive_find(mrb, archive, filename, exts[j]);
+        if (!mrb_nil_p(filepath)) {
+          if (cached && !mrb_nil_p(cache)) {
+            mrb_hash_set(mrb, cache, filename, filepath);
+          }
+          return filepath;
+        }
+      }
+      continue;
+    }
+    if (!mrb_nil_p(cache) && *fname != '/') {
+      mrb_value dir = feature_dir(mrb, mrb_ary_entry(load_path, i), fname, ptr - fname);
+
+      names = dir_index_file(mrb, dir);
+#ifdef USE_DIR_INDEX
+      if (mrb_nil_p(names) && st->dir_index) {
+        names = dir_listing(mrb, dir);
+        if (mrb_nil_p(names)) {
+          continue;
+        }
+      }
+#endif
+    }
+    for (j = 0; j < nexts; j++) {
+      /* only the candidate present in the index or listing touches the disk */
+      if (!mrb_nil_p(names) && !dir_listing_has(mrb, names, ptr, exts[j])) {
+        continue;
+      }
+      filepath = find_file_check(
+        mrb,
+        mrb_ary_entry(load_path, i),
+        filename,
+        exts[j],
+        t);
+      if (!mrb_nil_p(filepath)) {
+        if (cached && !mrb_nil_p(cache)) {
+          mrb_hash_set(mrb, cache, filename, filepath);
+          st->path_cache_dirty = 1;
+        }
+        return st->prefer_mrb ? newer_mrb(mrb, filepath, t) : filepath;
+      }
+    }
+  }
+
+  if (cached && !mrb_nil_p(cache)) {
+    mrb_hash_set(mrb, cache, filename, mrb_false_value());
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+find_file(mrb_state *mrb, mrb_value filename, int comp, struct load_target *t)
+{
+  const char *feature = RSTRING_CSTR(mrb, filename);
+  mrb_value filepath;
+
+  REQUIRE_PROBE(find_file__start, feature, NULL);
+  filepath = find_file_path(mrb, filename, comp, t);
+  if (mrb_nil_p(filepath)) {
+    REQUIRE_PROBE(find_file__end, feature, NULL);
+    mrb_load_fail(mrb, filename, "cannot load such file");
+  }
+  t->feature = feature;
+  /* paths built by find_file_path are NUL-terminated */
+  REQUIRE_PROBE(find_file__end, feature, RSTRING_PTR(filepath));
+  return filepath;
+}
+
+#ifdef USE_MRUBY_OLD_BYTE_CODE
+static void
+replace_stop_with_return(mrb_state *mrb, mrb_irep *irep)
+{
+  if (irep->iseq[irep->ilen - 1] == MKOP_A(OP_STOP, 0)) {
+    if (irep->flags == MRB_ISEQ_NO_FREE) {
+      mrb_code* iseq = (mrb_code *)mrb_malloc(mrb, (irep->ilen + 1) * sizeof(mrb_code));
+      memcpy(iseq, irep->iseq, irep->ilen * sizeof(mrb_code));
+      irep->iseq = iseq;
+      irep->flags &= ~MRB_ISEQ_NO_FREE;
+    } else {
+      irep->iseq = (mrb_code *)mrb_realloc(mrb, irep->iseq, (irep->ilen + 1) * sizeof(mrb_code));
+    }
+    irep->iseq[irep->ilen - 1] = MKOP_A(OP_LOADNIL, 0);
+    irep->iseq[irep->ilen] = MKOP_AB(OP_RETURN, 0, OP_R_NORMAL);
+    irep->ilen++;
+  }
+}
+#endif
+
+/*
+ * Checks that a RITE image fits in `size` bytes before handing it to
+ * mrb_read_irep, which trusts the size recorded in the header.
+ */
+#ifdef RITE_BINARY_MAJOR_VER
+# define RITE_BINARY_SIZE_OFFSET 8
+#else
+# define RITE_BINARY_SIZE_OFFSET 10
+#endif
+
+static int
+irep_size_ok(const void *bin, size_t size)
+{
+  return bin != NULL && size >= RITE_BINARY_SIZE_OFFSET + 4 &&
+    archive_u32((const uint8_t *)bin + RITE_BINARY_SIZE_OFFSET) <= size;
+}
+
+/*
+ * Keeps a mapping alive until the state is closed. Bytecode read with
+ * mrb_read_irep may point into it (iseq, literals and symbol names).
+ */
+static void
+keep_mapping(mrb_state *mrb, struct mapped_file *mf)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct mapped_file *tmp;
+
+  tmp = (struct mapped_file *)realloc(st->mappings, (st->nmappings + 1) * sizeof(struct mapped_file));
+  if (tmp == NULL) {
+    return;  /* never unmapped then, which is still safe */
+  }
+  st->mappings = tmp;
+  st->mappings[st->nmappings++] = *mf;
+}
+
+/*
+ * Memory taken by one load, for Require.memory_report. Allocated bytes
+ * and objects exclude nested loads, which are reported under their own
+ * path.
+ */
+struct require_memory {
+  struct require_memory *prev;  /* enclosing load */
+  uint64_t alloc_bytes;         /* st->alloc_bytes at the start */
+  mrb_int live;                 /* live objects at the start */
+  uint64_t nested_bytes;
+  mrb_int nested_objects;
+  size_t iseq, pool, syms, debug;  /* irep sizes */
+  size_t mapped;                /* shared object segments */
+};
+
+#ifdef USE_ALLOCF_COUNT
+/*
+ * Installed while a load is measured; adds up every size requested. The
+ * old size of a reallocated block is not known, so the count is gross.
+ */
+static void*
+require_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  struct require_state *st = (struct require_state *)ud;
+
+  st->alloc_bytes += size;
+  return st->allocf(mrb, p, size, st->allocf_ud);
+}
+#endif
+
+/* Starts measuring a load if accounting is on; returns whether it did. */
+static int
+memory_begin(mrb_state *mrb, struct require_memory *mem)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
+  if (!st->memory_on) {
+    return 0;
+  }
+  memset(mem, 0, sizeof(*mem));
+#ifdef USE_ALLOCF_COUNT
+  if (st->memory == NULL && mrb->allocf != require_allocf) {
+    st->allocf = mrb->allocf;
+    st->allocf_ud = mrb->allocf_ud;
+    mrb->allocf = require_allocf;
+    mrb->allocf_ud = st;
+  }
+#endif
+  mem->prev = st->memory;
+  mem->alloc_bytes = st->alloc_bytes;
+  mem->live = (mrb_int)mrb->gc.live;
+  st->memory = mem;
+  return 1;
+}
+
+/* Drops measuring back to `mem`, e.g. after an exception unwound past loads. */
+static void
+memory_unwind(struct require_state *st, mrb_state *mrb, struct require_memory *mem)
+{
+  st->memory = mem;
+#ifdef USE_ALLOCF_COUNT
+  if (mem == NULL && mrb->allocf == require_allocf) {
+    mrb->allocf = st->allocf;
+    mrb->allocf_ud = st->allocf_ud;
+  }
+#endif
+}
+
+static void
+memory_set(mrb_state *mrb, mrb_value hash, const char *key, mrb_value v)
+{
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_cstr(mrb, key)), v);
+}
+
+/* Records `mem` in the report under `filepath`. */
+static void
+memory_end(mrb_state *mrb, struct require_memory *mem, mrb_value filepath)
+{
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
+  uint64_t bytes = st->alloc_bytes - mem->alloc_bytes;
+  mrb_int objects = (mrb_int)mrb->gc.live - mem->live;
+  mrb_value report, entry;
+
+  if (mem->prev != NULL) {
+    mem->prev->nested_bytes += bytes;
+    mem->prev->nested_objects += objects;
+  }
+  memory_unwind(st, mrb, mem->prev);
+
+  report = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "memory"));
+  if (!mrb_hash_p(report)) {
+    report = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "memory"), report);
+  }
+  entry = mrb_hash_new(mrb);
+#ifdef USE_ALLOCF_COUNT
+  memory_set(mrb, entry, "allocated_bytes", mrb_fixnum_value((mrb_int)(bytes - mem->nested_bytes)));
+#else
+  memory_set(mrb, entry, "allocated_bytes", mrb_nil_value());
+#endif
+  memory_set(mrb, entry, "live_objects_delta", mrb_fixnum_value(objects - mem->nested_objects));
+  memory_set(mrb, entry, "iseq_bytes", mrb_fixnum_value((mrb_int)mem->iseq));
+  memory_set(mrb, entry, "pool_bytes", mrb_fixnum_value((mrb_int)mem->pool));
+  memory_set(mrb, entry, "syms_bytes", mrb_fixnum_value((mrb_int)mem->syms));
+  memory_set(mrb, entry, "debug_bytes", mrb_fixnum_value((mrb_int)mem->debug));
+  memory_set(mrb, entry, "mapped_bytes", mrb_fixnum_value((mrb_int)mem->mapped));
+  mrb_hash_set(mrb, report, filepath, entry);
+}
+
+static void
+memory_irep_add(struct require_memory *mem, const mrb_irep *irep)
+{
+  int i;
+
+  mem->iseq += irep->ilen * sizeof(mrb_code);
+  mem->pool += irep->plen * sizeof(irep->pool[0]);
+  mem->syms += irep->slen * sizeof(mrb_sym);
+  if (irep->debug_info != NULL) {
+    mem->debug += sizeof(*irep->debug_info) +
+                  irep->debug_info->flen * sizeof(irep->debug_info->files[0]);
+  }
+  for (i = 0; i < irep->rlen; i++) {
+    memory_irep_add(mem, irep->reps[i]);
+  }
+}
+
+/* Adds the sizes of `irep` and its children to the innermost load. */
+static void
+memory_irep(mrb_state *mrb, const mrb_irep *irep)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
+  if (st->memory != NULL && irep != NULL) {
+    memory_irep_add(st->memory, irep);
+  }
+}
+
+#ifdef USE_DL_ITERATE_PHDR
+struct mapped_query {
+  const char *path;
+  size_t size;
+};
+
+static int
+mapped_size_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+  struct mapped_query *q = (struct mapped_query *)data;
+  int i;
+
+  if (info->dlpi_name == NULL || strcmp(info->dlpi_name, q->path) != 0) {
+    return 0;
+  }
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    if (info->dlpi_phdr[i].p_type == PT_LOAD) {
+      q->size += info->dlpi_phdr[i].p_memsz;
+    }
+  }
+  return 1;
+}
+#endif
+
+/* Adds the loadable segments of the shared object at `path`, once mapped. */
+static void
+memory_mapped(mrb_state *mrb, const char *path)
+{
+#ifdef USE_DL_ITERATE_PHDR
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct mapped_query q;
+
+  if (st->memory == NULL || path == NULL) {
+    return;
+  }
+  q.path = path;
+  q.size = 0;
+  dl_iterate_phdr(mapped_size_cb, &q);
+  st->memory->mapped += q.size;
+#endif
+}
+
+static void
+load_mrb_file(mrb_state *mrb, mrb_value filepath, struct load_target *t)
+{
+  const char *fpath = RSTRING_CSTR(mrb, filepath);
+  int ai;
+  struct mapped_file mf;
+  struct require_span sp;
+  mrb_irep *irep;
+
+  REQUIRE_PROBE(load_mrb_file__start, t->feature, fpath);
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_READ, NULL);
+  if (map_target(t, &mf) != 0) {
+    mrb_load_fail(
+      mrb,
+      mrb_str_new_cstr(mrb, fpath),
+      "cannot load such file"
+    );
+    return;
+  }
+  if (!irep_size_ok(mf.ptr, mf.size)) {
+    unmap_file(&mf);
+    mrb_load_fail(mrb, filepath, "broken bytecode file");
+    return;
+  }
+  span_end(mrb, &sp);
+  require_stats(mrb)->bytecode_bytes += mf.size;
+
+  ai = mrb_gc_arena_save(mrb);
+
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_IREP, NULL);
+  irep = mrb_read_irep(mrb, (const uint8_t *)mf.ptr);
+  if (irep) {
+    keep_mapping(mrb, &mf);
+    memory_irep(mrb, irep);
+  } else {
+    unmap_file(&mf);
+  }
+  span_end(mrb, &sp);
+
+  mrb_gc_arena_restore(mrb, ai);
+
+  if (irep) {
+    struct RProc *proc;
+    /*
+    size_t i;
+    for (i = sirep; i < mrb->irep_len; i++) {
+      mrb->irep[i]->filename = mrb_string_value_ptr(mrb, filepath);
+    }
+    */
+
+#ifdef USE_MRUBY_OLD_BYTE_CODE
+    replace_stop_with_return(mrb, irep);
+#endif
+    proc = mrb_proc_new(mrb, irep);
+    MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
+
+    ai = mrb_gc_arena_save(mrb);
+    span_begin(mrb, &sp, MRB_REQUIRE_PHASE_EXEC, NULL);
+    mrb_yield_with_class(mrb, mrb_obj_value(proc), 0, NULL, mrb_top_self(mrb), mrb->object_class);
+    span_end(mrb, &sp);
+    mrb_gc_arena_restore(mrb, ai);
+  } else if (mrb->exc) {
+    // fail to load
+    longjmp(*(jmp_buf*)mrb->jmp, 1);
+  }
+  REQUIRE_PROBE(load_mrb_file__end, t->feature, fpath);
+}
+
+static void
+mrb_load_irep_data(mrb_state* mrb, const uint8_t* data)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  struct require_span sp;
+  mrb_irep *irep;
+
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_IREP, NULL);
+  irep = mrb_read_irep(mrb,data);
+  span_end(mrb, &sp);
+  memory_irep(mrb, irep);
+  mrb_gc_arena_restore(mrb,ai);
+
+  if (irep) {
+    int ai;
+    struct RProc *proc;
+
+#ifdef USE_MRUBY_OLD_BYTE_CODE
+    replace_stop_with_return(mrb, irep);
+#endif
+    proc = mrb_proc_new(mrb, irep);
+    MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
+
+    ai = mrb_gc_arena_save(mrb);
+    span_begin(mrb, &sp, MRB_REQUIRE_PHASE_EXEC, NULL);
+    mrb_yield_with_class(mrb, mrb_obj_value(proc), 0, NULL, mrb_top_self(mrb), mrb->object_class);
+    span_end(mrb, &sp);
+    mrb_gc_arena_restore(mrb, ai);
+  } else if (mrb->exc) {
+    // fail to load
+    longjmp(*(jmp_buf*)mrb->jmp, 1);
+  }
+}
+
+typedef void (*fn_mrb_gem_init)(mrb_state *mrb);
+typedef void (*fn_mrb_gem_final)(mrb_state *mrb);
+
+/*
+ * Process-wide registry of shared objects. The dlopen handle and the
+ * entry points are resolved once and shared by every state requiring
+ * the same file. A state is an owner from its first load until it is
+ * closed. Handles without owners stay open for reuse until
+ * mrb_require_dlclose_unused() is called.
+ */
+struct so_entry {
+  struct so_entry *next;
+  char *path;
+  const char *name;      /* file name part of path, for the probes */
+  void *handle;
+  fn_mrb_gem_init init;
+  fn_mrb_gem_final final;
+  const uint8_t *irep;
+  mrb_state **owners;
+  int nowners;
+};
+
+static struct so_entry *so_registry = NULL;
+
+#ifdef USE_PTHREAD
+static pthread_mutex_t so_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+# define so_registry_lock() pthread_mutex_lock(&so_registry_mutex)
+# define so_registry_unlock() pthread_mutex_unlock(&so_registry_mutex)
+#else
+# define so_registry_lock() ((void)0)
+# define so_registry_unlock() ((void)0)
+#endif
+
+/* Entry of the registry generated into the gem bundle by mrbgem.rake. */
+struct require_bundle_gem {
+  const char *name;
+  fn_mrb_gem_init init;
+  fn_mrb_gem_final final;
+  const uint8_t *irep;
+};
+
+/* Resolves the entry points named by `gem`. */
+static void
+so_entry_dlsym(struct so_entry *e, const struct require_gem *gem)
+{
+  e->init = gem->init ? (fn_mrb_gem_init) dlsym(e->handle, gem->init) : NULL;
+  e->final = gem->final ? (fn_mrb_gem_final) dlsym(e->handle, gem->final) : NULL;
+  e->irep = gem->irep ? (const uint8_t *)dlsym(e->handle, gem->irep) : NULL;
+  dlerror(); // clear last error
+}
+
+/*
+ * Resolves mrb_<name>_gem_init/_final and gem_mrblib_irep_<name>, or
+ * the entry points `bundled` describes: names from the gem table or a
+ * directory index, the registry of the bundle, or linked-in functions.
+ */
+static void
+so_entry_symbols(struct so_entry *e, const struct require_gem *bundled)
+{
+  char entry[PATH_MAX] = {0}, *ptr, *top, *tmp;
+  const struct require_gem *gem;
+
+  if (bundled != NULL && bundled->kind == REQUIRE_GEM_STATIC) {
+    e->init = bundled->static_init;
+    e->final = bundled->static_final;
+    e->irep = bundled->static_irep;
+    return;
+  }
+  if (bundled != NULL && bundled->kind == REQUIRE_GEM_BUNDLED) {
+    so_entry_dlsym(e, bundled);
+    return;
+  }
+  if (bundled != NULL) {
+    const struct require_bundle_gem *b;
+
+    b = (const struct require_bundle_gem *)dlsym(e->handle, "mrb_require_bundle");
+    for (; b && b->name; b++) {
+      if (strcmp(b->name, bundled->name) == 0) {
+        e->init = b->init;
+        e->final = b->final;
+        e->irep = b->irep;
+        break;
+      }
+    }
+    dlerror(); // clear last error
+    return;
+  }
+
+  tmp = top = ptr = strdup(e->path);
+  if (top == NULL) {
+    return;
+  }
+  while (tmp) {
     if ((tmp = strchr(ptr, '/')) || (tmp = strchr(ptr, '\\'))) {
       ptr = tmp + 1;
     }
   }
 
-  tmp = strrchr(ptr, '.');
-  if (tmp) *tmp = 0;
-  tmp = ptr;
-  while (*tmp) {
-    if (*tmp == '-') *tmp = '_';
-    tmp++;
+  tmp = strrchr(ptr, '.');
+  if (tmp) *tmp = 0;
+
+  /* entry point names of bundled gems are known from the build */
+  gem = require_gem_lookup(ptr, strlen(ptr));
+  if (gem && gem->kind == REQUIRE_GEM_BUNDLED) {
+    so_entry_dlsym(e, gem);
+    free(top);
+    return;
+  }
+
+  tmp = ptr;
+  while (*tmp) {
+    if (*tmp == '-') *tmp = '_';
+    tmp++;
+  }
+  snprintf(entry, sizeof(entry)-1, "mrb_%s_gem_init", ptr);
+  e->init = (fn_mrb_gem_init) dlsym(e->handle, entry);
+  snprintf(entry, sizeof(entry)-1, "mrb_%s_gem_final", ptr);
+  e->final = (fn_mrb_gem_final) dlsym(e->handle, entry);
+  snprintf(entry, sizeof(entry)-1, "gem_mrblib_irep_%s", ptr);
+  e->irep = (const uint8_t *)dlsym(e->handle, entry);
+  free(top);
+  dlerror(); // clear last error
+}
+
+/* The gem of the build a shared object is named after, or NULL. */
+static const struct require_gem*
+so_path_gem(const char *path)
+{
+  const char *base = path, *tmp;
+  size_t len;
+
+  for (tmp = path; *tmp; tmp++) {
+    if (*tmp == '/' || *tmp == '\\') {
+      base = tmp + 1;
+    }
+  }
+  tmp = strrchr(base, '.');
+  len = tmp ? (size_t)(tmp - base) : strlen(base);
+  return require_gem_lookup(base, len);
+}
+
+#ifndef _WIN32
+/*
+ * Whether the shared object may be opened RTLD_LOCAL: the build linked
+ * it to export nothing but its entry points, and no other gem links
+ * against it.
+ */
+static int
+so_gem_local(const char *path, const struct require_gem *gem)
+{
+  if (gem == NULL) {
+    gem = so_path_gem(path);
+    if (gem == NULL || gem->kind != REQUIRE_GEM_BUNDLED) {
+      return 0;
+    }
+  }
+  return (gem->flags & REQUIRE_GEM_LOCAL) != 0;
+}
+#endif
+
+static struct so_entry*
+so_entry_find(const char *path)
+{
+  struct so_entry *e;
+
+  for (e = so_registry; e; e = e->next) {
+    if (strcmp(e->path, path) == 0) {
+      break;
+    }
+  }
+  return e;
+}
+
+/*
+ * Returns the registry entry for `path`, calling dlopen only the first
+ * time the file is seen by any state. Members of the bundle have an
+ * entry each, keyed by "<bundle>/<gem>", sharing the handle of the
+ * bundle. Static gems get an entry without a handle, so that their
+ * finalizers run like those of shared objects. On failure *err is set.
+ */
+static struct so_entry*
+so_entry_open(const char *path, const struct require_gem *bundled, const char **err)
+{
+  struct so_entry *e, *found;
+  void *handle;
+
+  so_registry_lock();
+  e = so_entry_find(path);
+  so_registry_unlock();
+  if (e != NULL) {
+    return e;
+  }
+
+  /* not under the lock, so that preloading threads can dlopen concurrently */
+  if (bundled && bundled->kind == REQUIRE_GEM_STATIC) {
+    handle = NULL;
+  } else if ((handle = dlopen(bundled && bundled->kind == REQUIRE_GEM_IN_BUNDLE ? bundled->path : path,
+                               so_gem_local(path, bundled) ? RTLD_LAZY|RTLD_LOCAL : RTLD_LAZY|RTLD_GLOBAL)) == NULL) {
+    *err = dlerror();
+    return NULL;
+  }
+  e = (struct so_entry *)calloc(1, sizeof(struct so_entry));
+  if (e == NULL || (e->path = strdup(path)) == NULL) {
+    free(e);
+    if (handle) dlclose(handle);
+    *err = "out of memory";
+    return NULL;
+  }
+  e->name = strrchr(e->path, '/');
+  e->name = e->name ? e->name + 1 : e->path;
+  e->handle = handle;
+  so_entry_symbols(e, bundled);
+
+  so_registry_lock();
+  found = so_entry_find(path);
+  if (found == NULL) {
+    e->next = so_registry;
+    so_registry = e;
+  }
+  so_registry_unlock();
+
+  if (found != NULL) {
+    /* another thread won the race; drop our reference */
+    if (e->handle) dlclose(e->handle);
+    free(e->path);
+    free(e);
+    e = found;
+  }
+  return e;
+}
+
+/* Records `mrb` as an owner of `e`, once. */
+static void
+so_entry_own(mrb_state *mrb, struct so_entry *e)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  mrb_state **owners;
+  struct so_entry **sos;
+  int i;
+
+  so_registry_lock();
+  for (i = 0; i < e->nowners; i++) {
+    if (e->owners[i] == mrb) {
+      so_registry_unlock();
+      return;
+    }
+  }
+  owners = (mrb_state **)realloc(e->owners, (e->nowners + 1) * sizeof(mrb_state *));
+  if (owners != NULL) {
+    e->owners = owners;
+    e->owners[e->nowners++] = mrb;
+  }
+  so_registry_unlock();
+
+  sos = (struct so_entry **)realloc(st->sos, (st->nsos + 1) * sizeof(struct so_entry *));
+  if (sos != NULL) {
+    st->sos = sos;
+    st->sos[st->nsos++] = e;
+  }
+}
+
+/*
+ * Fills `gem` with the entry point names of the shared object `filepath`
+ * listed in the index of its directory. Returns 0 if it is not indexed.
+ */
+static int
+so_index_symbols(mrb_state *mrb, mrb_value filepath, struct require_gem *gem)
+{
+  const char *path = RSTRING_CSTR(mrb, filepath);
+  const char *base = strrchr(path, '/');
+  mrb_value names, syms;
+
+  if (base == NULL) {
+    return 0;
+  }
+  names = dir_index_file(mrb, mrb_str_new(mrb, path, base - path));
+  if (mrb_nil_p(names)) {
+    return 0;
+  }
+  syms = mrb_hash_get(mrb, names, mrb_str_new_cstr(mrb, base + 1));
+  if (!mrb_array_p(syms)) {
+    return 0;
+  }
+  memset(gem, 0, sizeof(*gem));
+  gem->kind = REQUIRE_GEM_BUNDLED;
+  gem->init = mrb_string_p(mrb_ary_entry(syms, 0)) ? RSTRING_CSTR(mrb, mrb_ary_entry(syms, 0)) : NULL;
+  gem->final = mrb_string_p(mrb_ary_entry(syms, 1)) ? RSTRING_CSTR(mrb, mrb_ary_entry(syms, 1)) : NULL;
+  gem->irep = mrb_string_p(mrb_ary_entry(syms, 2)) ? RSTRING_CSTR(mrb, mrb_ary_entry(syms, 2)) : NULL;
+  return 1;
+}
+
+static void
+load_so_file(mrb_state *mrb, mrb_value filepath, struct load_target *t)
+{
+  struct so_entry *e;
+  struct require_gem indexed;
+  const struct require_gem *gem = t->gem;
+  const char *const *deps = gem ? gem->deps : NULL;
+  const char *err = NULL;
+  const char *fpath = RSTRING_CSTR(mrb, filepath);
+  struct require_span sp;
+
+  REQUIRE_PROBE(load_so_file__start, t->feature, fpath);
+  /* the dynamic loader opens the file by path itself */
+  target_close(t);
+  if (deps == NULL) {
+    const struct require_gem *named = so_path_gem(fpath);
+
+    if (named != NULL && named->kind == REQUIRE_GEM_BUNDLED) {
+      deps = named->deps;
+    }
+  }
+  /*
+   * gems this one depends on, known from the build, are loaded first:
+   * dlopen binds data and function pointer relocations against them
+   * even with RTLD_LAZY
+   */
+  if (deps != NULL) {
+    const char *const *dep;
+    int ai = mrb_gc_arena_save(mrb);
+
+    for (dep = deps; *dep; dep++) {
+      mrb_require(mrb, mrb_str_new_cstr(mrb, *dep));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+  if (gem == NULL && so_index_symbols(mrb, filepath, &indexed)) {
+    gem = &indexed;
+  }
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_DLOPEN, NULL);
+  e = so_entry_open(fpath, gem, &err);
+  span_end(mrb, &sp);
+  if (e == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, err ? err : "dlopen failed");
+  }
+  if (!e->init && !e->irep) {
+      mrb_load_fail(mrb, filepath, "cannot load such file");
+  }
+  require_stats(mrb)->shared_objects++;
+  if (gem == NULL || gem->kind != REQUIRE_GEM_STATIC) {
+    memory_mapped(mrb, gem && gem->kind == REQUIRE_GEM_IN_BUNDLE ? gem->path : fpath);
+  }
+  if (e->init != NULL) {
+    int ai = mrb_gc_arena_save(mrb);
+    span_begin(mrb, &sp, MRB_REQUIRE_PHASE_INIT, NULL);
+    e->init(mrb);
+    span_end(mrb, &sp);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  if (e->irep != NULL) {
+    mrb_load_irep_data(mrb, e->irep);
+  }
+  /* only a gem whose init returned is finalized with the state */
+  so_entry_own(mrb, e);
+  REQUIRE_PROBE(load_so_file__end, t->feature, fpath);
+}
+
+/* Runs the gem finalizer for `mrb` and gives up its ownership of `e`. */
+static void
+unload_so_file(mrb_state *mrb, struct so_entry *e)
+{
+  int i;
+
+  /* the feature is not kept: the probes get the file name instead */
+  REQUIRE_PROBE(unload_so_file__start, e->name, e->path);
+  if (e->final != NULL) {
+    e->final(mrb);
+  }
+
+  so_registry_lock();
+  for (i = 0; i < e->nowners; i++) {
+    if (e->owners[i] == mrb) {
+      e->owners[i] = e->owners[--e->nowners];
+      break;
+    }
+  }
+  so_registry_unlock();
+  REQUIRE_PROBE(unload_so_file__end, e->name, e->path);
+}
+
+/*
+ * Not done from unload_so_file: mrb_close() still frees the objects of
+ * the state after the gem finalizers, and their dfree functions may live
+ * in the shared object.
+ */
+MRB_API int
+mrb_require_dlclose_unused(void)
+{
+  struct so_entry **p, *e;
+  int n = 0;
+
+  so_registry_lock();
+  p = &so_registry;
+  while ((e = *p) != NULL) {
+    if (e->nowners == 0) {
+      *p = e->next;
+      if (e->handle) dlclose(e->handle);
+      free(e->owners);
+      free(e->path);
+      free(e);
+      n++;
+    } else {
+      p = &e->next;
+    }
+  }
+  so_registry_unlock();
+
+  return n;
+}
+
+#ifdef USE_PTHREAD
+struct so_prefetch_job {
+  char **paths;
+  const struct require_gem **gems;  /* bundle member of each path, or NULL */
+  int npaths;
+  int next;
+  pthread_mutex_t mutex;
+};
+
+static void*
+so_prefetch_worker(void *arg)
+{
+  struct so_prefetch_job *job = (struct so_prefetch_job *)arg;
+  const char *err;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&job->mutex);
+    i = job->next++;
+    pthread_mutex_unlock(&job->mutex);
+    if (i >= job->npaths) {
+      break;
+    }
+    /* failures are reported by the require that follows */
+    so_entry_open(job->paths[i], job->gems[i], &err);
+  }
+  return NULL;
+}
+
+/* `names` followed by the gems they depend on, each once. */
+static mrb_value
+so_prefetch_closure(mrb_state *mrb, mrb_value names)
+{
+  mrb_value all = mrb_ary_dup(mrb, names);
+  mrb_value seen = mrb_hash_new(mrb);
+  mrb_int i;
+
+  for (i = 0; i < RARRAY_LEN(all); i++) {
+    mrb_value name = mrb_ary_entry(all, i);
+    const struct require_gem *gem = require_gem_lookup(RSTRING_PTR(name), RSTRING_LEN(name));
+    const char *const *dep;
+
+    mrb_hash_set(mrb, seen, name, mrb_true_value());
+    for (dep = gem ? gem->deps : NULL; dep && *dep; dep++) {
+      mrb_value d = mrb_str_new_cstr(mrb, *dep);
+      if (!mrb_hash_key_p(mrb, seen, d)) {
+        mrb_hash_set(mrb, seen, d, mrb_true_value());
+        mrb_ary_push(mrb, all, d);
+      }
+    }
+  }
+  return all;
+}
+
+/*
+ * dlopens the shared objects among the features `names` and the gems
+ * they depend on, on up to `nthreads` threads, so relocation and page-in
+ * overlap. Gem init functions and mrblib ireps are not run here: the
+ * requires that follow do that on this thread, in dependency order,
+ * reusing the handles.
+ */
+static void
+so_prefetch(mrb_state *mrb, mrb_value names, int nthreads)
+{
+  struct so_prefetch_job job;
+  pthread_t *threads;
+  int i, nstarted = 0, bundle_queued = 0;
+  int ai;
+
+  names = so_prefetch_closure(mrb, names);
+  ai = mrb_gc_arena_save(mrb);
+  job.paths = (char **)calloc(RARRAY_LEN(names) + 1, sizeof(char *));
+  job.gems = (const struct require_gem **)calloc(RARRAY_LEN(names) + 1, sizeof(struct require_gem *));
+  job.npaths = 0;
+  job.next = 0;
+  if (job.paths == NULL || job.gems == NULL) {
+    free(job.paths);
+    free(job.gems);
+    return;
+  }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    struct load_target t;
+    mrb_value filepath;
+    const char *ext;
+
+    /* at the top, so the iterations that `continue` release theirs too */
+    mrb_gc_arena_restore(mrb, ai);
+    filepath = find_file_path(mrb, mrb_ary_entry(names, i), 1, &t);
+    target_close(&t);
+    if (!mrb_string_p(filepath) || !mrb_nil_p(archive_file_ref(mrb, filepath))) {
+      continue;
+    }
+    if (t.gem != NULL) {
+      /* one dlopen of the bundle serves all of its members */
+      if (t.gem->kind == REQUIRE_GEM_IN_BUNDLE && !bundle_queued) {
+        job.gems[job.npaths] = t.gem;
+        job.paths[job.npaths++] = strdup(RSTRING_CSTR(mrb, filepath));
+        if (job.paths[job.npaths - 1] == NULL) {
+          job.npaths--;
+        }
+        bundle_queued = 1;
+      }
+      continue;
+    }
+    ext = strrchr(RSTRING_CSTR(mrb, filepath), '.');
+    if (ext && (strcmp(ext, ".so") == 0 || strcmp(ext, ".dll") == 0 || strcmp(ext, ".dylib") == 0)) {
+      job.paths[job.npaths++] = strdup(RSTRING_CSTR(mrb, filepath));
+      if (job.paths[job.npaths - 1] == NULL) {
+        job.npaths--;
+      }
+    }
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  if (nthreads > job.npaths) {
+    nthreads = job.npaths;
   }
-  snprintf(entry, sizeof(entry)-1, "mrb_%s_gem_final", ptr);
+  threads = (pthread_t *)calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+  pthread_mutex_init(&job.mutex, NULL);
+  /* this thread works too, so one fewer is started */
+  for (i = 1; threads && i < nthreads; i++) {
+    if (pthread_create(&threads[nstarted], NULL, so_prefetch_worker, &job) == 0) {
+      nstarted++;
+    }
+  }
+  so_prefetch_worker(&job);
+  for (i = 0; i < nstarted; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&job.mutex);
 
-  fn = (fn_mrb_gem_final) dlsym(handle, entry);
-  free(top);
-  if (fn == NULL) {
-    return;
+  free(threads);
+  for (i = 0; i < job.npaths; i++) {
+    free(job.paths[i]);
+  }
+  free(job.paths);
+  free(job.gems);
+}
+#endif
+
+#ifndef MRB_REQUIRE_NO_COMPILER
+/*
+ * Raises the error that kept `filepath` from compiling. With no_exec the
+ * parser leaves it in mrb->exc instead of raising, and returns no proc.
+ */
+static void
+compile_fail(mrb_state *mrb, mrb_value filepath)
+{
+  if (mrb->exc != NULL) {
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->exc));
+  }
+  mrb_raisef(mrb, E_SCRIPT_ERROR, "cannot compile %S", filepath);
+}
+
+/*
+ * Path of the compile cache entry for a source file, or nil when the cache
+ * is disabled. Entries are named by a hash of the source path, size,
+ * mtime and the bytecode format, so an edited file or an mruby upgrade
+ * simply misses and writes a new entry.
+ */
+static mrb_value
+compile_cache_path(mrb_state *mrb, const char *fpath, const struct stat *sb)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  char key[128];
+  uint64_t h;
+  mrb_value cachepath;
+
+  if (st->cache_dir == NULL) {
+    return mrb_nil_value();
   }
 
-  fn(mrb);
+  snprintf(key, sizeof(key), "%lld:%lld:%d:" RITE_BINARY_IDENT RITE_BINARY_FORMAT_VER,
+           (long long)sb->st_size, (long long)sb->st_mtime, (int)MRUBY_RELEASE_NO);
+  h = fnv1a(FNV_OFFSET_BASIS, fpath, strlen(fpath) + 1);
+  h = fnv1a(h, key, strlen(key));
+  snprintf(key, sizeof(key), "/%016llx.mrb", (unsigned long long)h);
+
+  cachepath = mrb_str_new_cstr(mrb, st->cache_dir);
+  mrb_str_cat2(mrb, cachepath, key);
+  return cachepath;
 }
 
 static void
-load_rb_file(mrb_state *mrb, mrb_value filepath)
+compile_cache_write(mrb_state *mrb, mrb_value cachepath, const mrb_irep *irep)
 {
+  uint8_t *bin = NULL;
+  size_t bin_size = 0;
+  char tmp[MAXPATHLEN];
   FILE *fp;
+  int ok;
+
+  if (mrb_dump_irep(mrb, irep, MRB_DUMP_DEBUG_INFO, &bin, &bin_size) != MRB_DUMP_OK) {
+    return;
+  }
+
+  /* write aside and rename, so concurrent processes never see a torn entry */
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", RSTRING_CSTR(mrb, cachepath), (int)getpid());
+  fp = fopen(tmp, "wb");
+  if (fp != NULL) {
+    ok = fwrite(bin, 1, bin_size, fp) == bin_size;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp, RSTRING_CSTR(mrb, cachepath)) != 0) {
+      remove(tmp);
+    }
+  }
+  mrb_free(mrb, bin);
+}
+
+static void
+load_rb_file(mrb_state *mrb, mrb_value filepath, struct load_target *t)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct load_target cached;
+  struct mapped_file mf;
+  struct mrb_parser_state *p;
+  struct require_span sp;
   const char *fpath = RSTRING_CSTR(mrb, filepath);
   mrbc_context *mrbc_ctx;
+  mrb_value cachepath, result;
   int ai = mrb_gc_arena_save(mrb);
 
-  fp = fopen((const char*)fpath, "r");
-  if (fp == NULL) {
+  REQUIRE_PROBE(load_rb_file__start, t->feature, fpath);
+  cachepath = compile_cache_path(mrb, fpath, &t->sb);
+  if (!mrb_nil_p(cachepath) && target_open(RSTRING_CSTR(mrb, cachepath), &cached) == 0) {
+    target_close(t);
+    cached.feature = t->feature;
+    load_mrb_file(mrb, cachepath, &cached);
+    mrb_gc_arena_restore(mrb, ai);
+    REQUIRE_PROBE(load_rb_file__end, t->feature, fpath);
+    return;
+  }
+
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_READ, NULL);
+  if (map_target(t, &mf) != 0) {
     mrb_load_fail(mrb, filepath, "cannot load such file");
     return;
   }
+  span_end(mrb, &sp);
+  st->stats.source_bytes += mf.size;
 
   mrbc_ctx = mrbc_context_new(mrb);
 
   mrbc_filename(mrb, mrbc_ctx, fpath);
-  mrb_load_file_cxt(mrb, fp, mrbc_ctx);
-  fclose(fp);
+  /* compiled and run in two steps, so each can be timed, cached and measured */
+  mrbc_ctx->no_exec = TRUE;
+  /* the parser copies what it needs, so the source is unmapped before running */
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_PARSE, NULL);
+  p = mrb_parse_nstring(mrb, mf.ptr ? (const char *)mf.ptr : "", mf.size, mrbc_ctx);
+  unmap_file(&mf);
+  result = mrb_load_exec(mrb, p, mrbc_ctx);
+  mrbc_context_free(mrb, mrbc_ctx);
+  span_end(mrb, &sp);
+
+  if (mrb_type(result) == MRB_TT_PROC) {
+    struct RProc *proc = mrb_proc_ptr(result);
+
+    memory_irep(mrb, proc->body.irep);
+    if (!mrb_nil_p(cachepath)) {
+      compile_cache_write(mrb, cachepath, proc->body.irep);
+    }
+#ifdef USE_MRUBY_OLD_BYTE_CODE
+    replace_stop_with_return(mrb, (mrb_irep *)proc->body.irep);
+#endif
+    MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
+    span_begin(mrb, &sp, MRB_REQUIRE_PHASE_EXEC, NULL);
+    mrb_yield_with_class(mrb, result, 0, NULL, mrb_top_self(mrb), mrb->object_class);
+    span_end(mrb, &sp);
+  } else {
+    compile_fail(mrb, filepath);
+  }
 
   mrb_gc_arena_restore(mrb, ai);
-  mrbc_context_free(mrb, mrbc_ctx);
+  REQUIRE_PROBE(load_rb_file__end, t->feature, fpath);
+}
+#else
+/* Built without the parser: only bytecode and shared objects load. */
+static void
+load_rb_file(mrb_state *mrb, mrb_value filepath, struct load_target *t)
+{
+  target_close(t);
+  mrb_load_fail(mrb, filepath, "cannot load Ruby source without a compiler");
 }
+#endif
 
+/* Loads a feature resolved by archive_find straight from the mapping. */
 static void
-load_file(mrb_state *mrb, mrb_value filepath)
+load_archive_member(mrb_state *mrb, mrb_value filepath, mrb_value ref)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct require_archive *ar = &st->archives[mrb_fixnum(mrb_ary_entry(ref, 0))];
+  struct archive_member *m = &ar->members[mrb_fixnum(mrb_ary_entry(ref, 1))];
+  const char *data = (const char *)ar->file.ptr + m->offset;
+  size_t size = m->size;
+
+  if (m->flags & ARCHIVE_DEFLATE) {
+#ifdef MRB_REQUIRE_USE_ZLIB
+    if (m->inflated == NULL) {
+      struct require_span sp;
+      uLongf len = m->raw_size;
+      void *buf;
+
+      span_begin(mrb, &sp, MRB_REQUIRE_PHASE_READ, NULL);
+      buf = malloc(len ? len : 1);
+      if (buf == NULL ||
+          uncompress((Bytef *)buf, &len, (const Bytef *)data, m->size) != Z_OK ||
+          len != m->raw_size) {
+        free(buf);
+        mrb_load_fail(mrb, filepath, "broken archive member");
+        return;
+      }
+      /* kept until the state is closed: bytecode may point into it */
+      m->inflated = buf;
+      span_end(mrb, &sp);
+    }
+    data = (const char *)m->inflated;
+    size = m->raw_size;
+#else
+    mrb_load_fail(mrb, filepath, "compressed archive member needs zlib support");
+    return;
+#endif
+  }
+
+  if (m->type == 'm') {
+    if (!irep_size_ok(data, size)) {
+      mrb_load_fail(mrb, filepath, "broken archive member");
+      return;
+    }
+    st->stats.bytecode_bytes += size;
+    mrb_load_irep_data(mrb, (const uint8_t *)data);
+  } else {
+#ifndef MRB_REQUIRE_NO_COMPILER
+    mrbc_context *mrbc_ctx = mrbc_context_new(mrb);
+    struct require_span sp;
+    mrb_value result;
+    int ai = mrb_gc_arena_save(mrb);
+
+    mrbc_filename(mrb, mrbc_ctx, RSTRING_CSTR(mrb, filepath));
+    st->stats.source_bytes += size;
+    /* compiled and run in two steps, like load_rb_file */
+    mrbc_ctx->no_exec = TRUE;
+    span_begin(mrb, &sp, MRB_REQUIRE_PHASE_PARSE, NULL);
+    result = mrb_load_nstring_cxt(mrb, data, size, mrbc_ctx);
+    mrbc_context_free(mrb, mrbc_ctx);
+    span_end(mrb, &sp);
+    if (mrb_type(result) == MRB_TT_PROC) {
+      struct RProc *proc = mrb_proc_ptr(result);
+
+      memory_irep(mrb, proc->body.irep);
+#ifdef USE_MRUBY_OLD_BYTE_CODE
+      replace_stop_with_return(mrb, (mrb_irep *)proc->body.irep);
+#endif
+      MRB_PROC_SET_TARGET_CLASS(proc, mrb->object_class);
+      span_begin(mrb, &sp, MRB_REQUIRE_PHASE_EXEC, NULL);
+      mrb_yield_with_class(mrb, result, 0, NULL, mrb_top_self(mrb), mrb->object_class);
+      span_end(mrb, &sp);
+    } else {
+      compile_fail(mrb, filepath);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+#else
+    mrb_load_fail(mrb, filepath, "cannot load Ruby source without a compiler");
+#endif
+  }
+}
+
+static enum mrb_require_loader
+file_loader(mrb_state *mrb, mrb_value filepath, struct load_target *t)
 {
   char *ext = strrchr(RSTRING_CSTR(mrb, filepath), '.');
 
+  if (!mrb_nil_p(archive_file_ref(mrb, filepath))) {
+    return MRB_REQUIRE_LOADER_ARCHIVE;
+  }
+  if (t->gem != NULL) {
+    return MRB_REQUIRE_LOADER_SO;
+  }
+
   if (!ext || strcmp(ext, ".rb") == 0) {
-    load_rb_file(mrb, filepath);
+    return MRB_REQUIRE_LOADER_RB;
   } else if (strcmp(ext, ".mrb") == 0) {
-    load_mrb_file(mrb, filepath);
+    return MRB_REQUIRE_LOADER_MRB;
   } else if (strcmp(ext, ".so") == 0 ||
              strcmp(ext, ".dll") == 0 ||
              strcmp(ext, ".dylib") == 0) {
-    load_so_file(mrb, filepath);
+    return MRB_REQUIRE_LOADER_SO;
   } else {
-    load_rb_file(mrb, filepath);
+    return MRB_REQUIRE_LOADER_RB;
+  }
+}
+
+static void
+load_file(mrb_state *mrb, mrb_value filepath, struct load_target *t, enum mrb_require_loader loader)
+{
+  if (t->tracked) {
+    /* the loader owns the file from here */
+    ((struct require_state *)DATA_PTR(require_state_value(mrb)))->pending_fd = -1;
+  }
+  switch (loader) {
+  case MRB_REQUIRE_LOADER_ARCHIVE:
+    target_close(t);
+    load_archive_member(mrb, filepath, archive_file_ref(mrb, filepath));
+    break;
+  case MRB_REQUIRE_LOADER_MRB:
+    load_mrb_file(mrb, filepath, t);
+    break;
+  case MRB_REQUIRE_LOADER_SO:
+    load_so_file(mrb, filepath, t);
+    break;
+  default:
+    load_rb_file(mrb, filepath, t);
+    break;
   }
 }
 
+MRB_API void
+mrb_require_set_hooks(mrb_state *mrb,
+                      mrb_require_hook before_resolve,
+                      mrb_require_hook after_resolve,
+                      mrb_require_hook before_load,
+                      mrb_require_hook after_load,
+                      mrb_require_hook on_error,
+                      void *ud)
+{
+  struct require_hooks *h = &((struct require_state *)DATA_PTR(require_state_value(mrb)))->hooks;
+
+  h->before_resolve = before_resolve;
+  h->after_resolve = after_resolve;
+  h->before_load = before_load;
+  h->after_load = after_load;
+  h->on_error = on_error;
+  h->ud = ud;
+  h->any = before_resolve || after_resolve || before_load || after_load || on_error;
+}
+
+static void
+event_init(mrb_state *mrb, struct mrb_require_event *ev, mrb_value filename, mrb_bool require)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
+  ev->feature = RSTRING_CSTR(mrb, filename);
+  ev->path = NULL;
+  ev->loader = MRB_REQUIRE_LOADER_RB;
+  ev->require = require;
+  ev->start_ns = st->hooks.any ? require_clock() : 0;
+  ev->elapsed_ns = 0;
+  ev->exc = mrb_nil_value();
+}
+
+/* Calls `hook` if it is installed; a single test when it is not. */
+static void
+event_hook(mrb_state *mrb, mrb_require_hook hook, struct mrb_require_event *ev)
+{
+  if (hook != NULL) {
+    struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
+    ev->elapsed_ns = require_clock() - ev->start_ns;
+    hook(mrb, ev, st->hooks.ud);
+  }
+}
+
+typedef mrb_value (*require_body)(mrb_state *mrb, mrb_value filename, mrb_value key, struct load_target *t, struct mrb_require_event *ev);
+
+/*
+ * Runs `body` with a target for the file it resolves. With hooks or
+ * memory accounting, an exception is caught on its way out: the file is
+ * closed if its loader did not take it yet, the loads it unwound stop
+ * being measured, and on_error is told once, by the innermost require.
+ * Otherwise no handler is set up; a file left open by a require that
+ * raised is recorded in pending_fd and closed by the next one.
+ */
+static mrb_value
+require_guarded(mrb_state *mrb, require_body body, mrb_value filename, mrb_value key, struct mrb_require_event *ev)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct require_memory *memory = st->memory;
+  struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  struct load_target t;
+  mrb_value result = mrb_nil_value();
+
+  t.fd = -1;
+  t.tracked = 0;
+  if (!st->hooks.any && !st->memory_on) {
+    if (st->pending_fd >= 0) {
+      close(st->pending_fd);
+      st->pending_fd = -1;
+    }
+    t.tracked = 1;
+    return body(mrb, filename, key, &t, ev);
+  }
+  MRB_TRY(&c_jmp) {
+    mrb->jmp = &c_jmp;
+    result = body(mrb, filename, key, &t, ev);
+    mrb->jmp = prev_jmp;
+  } MRB_CATCH(&c_jmp) {
+    struct RObject *exc = mrb->exc;
+
+    mrb->jmp = prev_jmp;
+    target_close(&t);
+    memory_unwind(st, mrb, memory);
+    if (exc != st->reported && st->hooks.on_error != NULL) {
+      /* kept referenced, so no later exception can reuse its address */
+      st->reported = exc;
+      mrb_iv_set(mrb, require_state_value(mrb), mrb_intern_lit(mrb, "reported"), mrb_obj_value(exc));
+      ev->exc = mrb_obj_value(exc);
+      event_hook(mrb, st->hooks.on_error, ev);
+    }
+    mrb->exc = exc;
+    if (prev_jmp != NULL) {
+      MRB_THROW(prev_jmp);
+    }
+    mrb_exc_raise(mrb, mrb_obj_value(exc));
+  } MRB_END_EXC(&c_jmp);
+  return result;
+}
+
+static mrb_value
+load_feature(mrb_state *mrb, mrb_value filename, mrb_value key, struct load_target *t, struct mrb_require_event *ev)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct require_hooks *hooks = &st->hooks;
+  struct require_span sp, resolve;
+  struct require_memory mem;
+  int measured;
+  mrb_value filepath;
+
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_LOAD, ev->feature);
+  event_hook(mrb, hooks->before_resolve, ev);
+  span_begin(mrb, &resolve, MRB_REQUIRE_PHASE_RESOLVE, NULL);
+  filepath = find_file(mrb, filename, 0, t);
+  span_end(mrb, &resolve);
+  if (t->tracked) {
+    st->pending_fd = t->fd;
+  }
+  ev->path = RSTRING_CSTR(mrb, filepath);
+  ev->loader = file_loader(mrb, filepath, t);
+  event_hook(mrb, hooks->after_resolve, ev);
+  span_path(mrb, &sp, filepath);
+  event_hook(mrb, hooks->before_load, ev);
+  measured = memory_begin(mrb, &mem);
+  load_file(mrb, filepath, t, ev->loader);
+  if (measured) {
+    memory_end(mrb, &mem, filepath);
+  }
+  event_hook(mrb, hooks->after_load, ev);
+  span_end(mrb, &sp);
+  return mrb_true_value(); // TODO: ??
+}
+
 mrb_value
 mrb_load(mrb_state *mrb, mrb_value filename)
 {
-  mrb_value filepath = find_file(mrb, filename, 0);
-  load_file(mrb, filepath);
-  return mrb_true_value(); // TODO: ??
+  struct mrb_require_event ev;
+
+  require_stats(mrb)->loads++;
+  event_init(mrb, &ev, filename, FALSE);
+  return require_guarded(mrb, load_feature, filename, mrb_nil_value(), &ev);
 }
 
 mrb_value
@@ -488,32 +2934,83 @@ mrb_f_load(mrb_state *mrb, mrb_value self)
   return mrb_load(mrb, filename);
 }
 
-static int
-loaded_files_check(mrb_state *mrb, mrb_value filepath)
+/*
+ * Returns the hash index of $", mapping each path to its position. It
+ * is rebuilt whenever $" was replaced or resized behind our back (e.g.
+ * `$".delete(path)` to allow reloading), or with `force` when a hit no
+ * longer matches $" because it was edited in place.
+ */
+static mrb_value
+loaded_files_index(mrb_state *mrb, int force)
 {
-  mrb_value loading_files;
+  mrb_value self = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(self);
   mrb_value loaded_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\""));
+  mrb_value index = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "loaded_index"));
+  mrb_value source = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "loaded_source"));
   int i;
+
+  if (!force &&
+      mrb_hash_p(index) &&
+      mrb_obj_eq(mrb, source, loaded_files) &&
+      st->loaded_len == RARRAY_LEN(loaded_files)) {
+    return index;
+  }
+
+  index = mrb_hash_new(mrb);
   for (i = 0; i < RARRAY_LEN(loaded_files); i++) {
-    if (mrb_str_cmp(
-        mrb,
-        mrb_ary_entry(loaded_files, i),
-        filepath) == 0) {
-      return 0;
+    mrb_value f = mrb_ary_entry(loaded_files, i);
+    if (mrb_string_p(f)) {
+      mrb_hash_set(mrb, index, f, mrb_fixnum_value(i));
     }
   }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "loaded_index"), index);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "loaded_source"), loaded_files);
+  st->loaded_len = RARRAY_LEN(loaded_files);
 
-  loading_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\"_"));
-  if (mrb_nil_p(loading_files)) {
+  return index;
+}
+
+/* Whether `filepath` is in $", confirming a hit of the index against it. */
+static int
+loaded_files_include_p(mrb_state *mrb, mrb_value filepath)
+{
+  mrb_value loaded_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\""));
+  mrb_value pos = mrb_hash_get(mrb, loaded_files_index(mrb, 0), filepath);
+  mrb_value f;
+
+  if (!mrb_fixnum_p(pos)) {
+    return 0;
+  }
+  f = mrb_ary_entry(loaded_files, mrb_fixnum(pos));
+  if (mrb_string_p(f) && mrb_str_equal(mrb, f, filepath)) {
     return 1;
   }
-  for (i = 0; i < RARRAY_LEN(loading_files); i++) {
-    if (mrb_str_cmp(
-        mrb,
-        mrb_ary_entry(loading_files, i),
-        filepath) == 0) {
-      return 0;
-    }
+  pos = mrb_hash_get(mrb, loaded_files_index(mrb, 1), filepath);
+  return mrb_fixnum_p(pos);
+}
+
+static mrb_value
+loading_files_index(mrb_state *mrb)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_value index = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "loading_index"));
+
+  if (!mrb_hash_p(index)) {
+    index = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "loading_index"), index);
+  }
+  return index;
+}
+
+static int
+loaded_files_check(mrb_state *mrb, mrb_value filepath)
+{
+  if (loaded_files_include_p(mrb, filepath)) {
+    return 0;
+  }
+  if (mrb_hash_key_p(mrb, loading_files_index(mrb), filepath)) {
+    return 0;
   }
 
   return 1;
@@ -528,6 +3025,7 @@ loading_files_add(mrb_state *mrb, mrb_value filepath)
     mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$\"_"), loading_files);
   }
   mrb_ary_push(mrb, loading_files, filepath);
+  mrb_hash_set(mrb, loading_files_index(mrb), filepath, mrb_true_value());
 
   return;
 }
@@ -536,10 +3034,19 @@ static void
 loading_files_delete(mrb_state *mrb, mrb_value filepath)
 {
   mrb_value loading_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\"_"));
+  mrb_int len;
   if (!mrb_array_p(loading_files)) {
     return;
   }
-  mrb_funcall(mrb, loading_files, "delete", 1, filepath);
+  mrb_hash_delete_key(mrb, loading_files_index(mrb), filepath);
+
+  /* $"_ is a stack of nested loads, so the entry is almost always on top */
+  len = RARRAY_LEN(loading_files);
+  if (len > 0 && mrb_str_equal(mrb, mrb_ary_entry(loading_files, len - 1), filepath)) {
+    mrb_ary_pop(mrb, loading_files);
+  } else {
+    mrb_funcall(mrb, loading_files, "delete", 1, filepath);
+  }
 
   return;
 }
@@ -547,26 +3054,154 @@ loading_files_delete(mrb_state *mrb, mrb_value filepath)
 static void
 loaded_files_add(mrb_state *mrb, mrb_value filepath)
 {
+  mrb_value index = loaded_files_index(mrb, 0);
   mrb_value loaded_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\""));
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
   mrb_ary_push(mrb, loaded_files, filepath);
+  mrb_hash_set(mrb, index, filepath, mrb_fixnum_value(RARRAY_LEN(loaded_files) - 1));
+  st->loaded_len = RARRAY_LEN(loaded_files);
   return;
 }
 
-mrb_value
-mrb_require(mrb_state *mrb, mrb_value filename)
+/*
+ * Key of the feature index: the requested name with a trailing .rb/.mrb/.so
+ * stripped, so `require "foo"` and `require "foo.rb"` share an entry.
+ * Names relative to the current directory are not indexed.
+ */
+static mrb_value
+feature_key(mrb_state *mrb, mrb_value filename)
+{
+  static const char *exts[] = { ".rb", ".mrb", ".so", NULL };
+  const char *name = RSTRING_PTR(filename);
+  mrb_int len = RSTRING_LEN(filename);
+  int i;
+
+  if (len == 0 || name[0] == '.') {
+    return mrb_nil_value();
+  }
+  for (i = 0; exts[i]; i++) {
+    mrb_int elen = strlen(exts[i]);
+    if (len > elen && memcmp(name + len - elen, exts[i], elen) == 0) {
+      len -= elen;
+      break;
+    }
+  }
+
+  return mrb_str_new(mrb, name, len);
+}
+
+static mrb_value
+feature_index(mrb_state *mrb)
+{
+  mrb_value self = require_state_value(mrb);
+  mrb_value index = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "feature_index"));
+
+  if (!mrb_hash_p(index)) {
+    index = mrb_hash_new(mrb);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "feature_index"), index);
+  }
+  return index;
+}
+
+/*
+ * True when `filename` was already required as `filepath`. An explicit
+ * extension in the request must match the one of the loaded file.
+ */
+static int
+feature_provided_p(mrb_state *mrb, mrb_value filename, mrb_value key, mrb_value filepath)
+{
+  mrb_int elen = RSTRING_LEN(filename) - RSTRING_LEN(key);
+
+  if (elen > 0 &&
+      (RSTRING_LEN(filepath) < elen ||
+       memcmp(RSTRING_PTR(filepath) + RSTRING_LEN(filepath) - elen,
+              RSTRING_PTR(filename) + RSTRING_LEN(key), elen) != 0)) {
+    return 0;
+  }
+  return !loaded_files_check(mrb, filepath);
+}
+
+static mrb_value
+require_feature(mrb_state *mrb, mrb_value filename, mrb_value key, struct load_target *t, struct mrb_require_event *ev)
 {
-  mrb_value filepath = find_file(mrb, filename, 1);
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  struct require_span sp, resolve;
+  struct require_memory mem;
+  int measured;
+  mrb_value filepath;
+
+  span_begin(mrb, &sp, MRB_REQUIRE_PHASE_REQUIRE, ev->feature);
+  event_hook(mrb, st->hooks.before_resolve, ev);
+  span_begin(mrb, &resolve, MRB_REQUIRE_PHASE_RESOLVE, NULL);
+  filepath = find_file(mrb, filename, 1, t);
+  span_end(mrb, &resolve);
+  if (t->tracked) {
+    st->pending_fd = t->fd;
+  }
+  if (!mrb_nil_p(key) && !mrb_nil_p(filepath)) {
+    mrb_hash_set(mrb, feature_index(mrb), key, filepath);
+  }
+  if (!mrb_nil_p(filepath)) {
+    ev->path = RSTRING_CSTR(mrb, filepath);
+    ev->loader = file_loader(mrb, filepath, t);
+    event_hook(mrb, st->hooks.after_resolve, ev);
+  }
   if (!mrb_nil_p(filepath) && loaded_files_check(mrb, filepath)) {
+    span_path(mrb, &sp, filepath);
     loading_files_add(mrb, filepath);
-    load_file(mrb, filepath);
+    event_hook(mrb, st->hooks.before_load, ev);
+    measured = memory_begin(mrb, &mem);
+    load_file(mrb, filepath, t, ev->loader);
+    if (measured) {
+      memory_end(mrb, &mem, filepath);
+    }
+    event_hook(mrb, st->hooks.after_load, ev);
     loaded_files_add(mrb, filepath);
     loading_files_delete(mrb, filepath);
+    span_end(mrb, &sp);
     return mrb_true_value();
   }
 
+  target_close(t);
+  if (t->tracked) {
+    st->pending_fd = -1;
+  }
+  span_end(mrb, &sp);
+  st->stats.already_loaded++;
   return mrb_false_value();
 }
 
+mrb_value
+mrb_require(mrb_state *mrb, mrb_value filename)
+{
+  mrb_value filepath;
+  mrb_value key = feature_key(mrb, filename);
+  const struct require_gem *gem;
+  struct mrb_require_event ev;
+  struct mrb_require_stats *stats = require_stats(mrb);
+
+  stats->requires++;
+  /* already required under this name: answer without touching the disk */
+  if (!mrb_nil_p(key)) {
+    filepath = mrb_hash_get(mrb, feature_index(mrb), key);
+    if (mrb_string_p(filepath) && feature_provided_p(mrb, filename, key, filepath)) {
+      stats->already_loaded++;
+      return mrb_false_value();
+    }
+  }
+
+  /* linked into libmruby and initialized along with it */
+  gem = require_gem_lookup(RSTRING_PTR(filename), RSTRING_LEN(filename));
+  if (gem && gem->kind == REQUIRE_GEM_COMPILED_IN) {
+    stats->already_loaded++;
+    return mrb_false_value();
+  }
+
+  event_init(mrb, &ev, filename, TRUE);
+  return require_guarded(mrb, require_feature, filename, key, &ev);
+}
+
 mrb_value
 mrb_f_require(mrb_state *mrb, mrb_value self)
 {
@@ -604,12 +3239,110 @@ mrb_load_error_path(mrb_state *mrb, mrb_value self)
   return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "path"));
 }
 
+static mrb_value
+mrb_require_s_profile(mrb_state *mrb, mrb_value self)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+
+  return st->profile ? mrb_str_new_cstr(mrb, st->profile) : mrb_nil_value();
+}
+
+/*
+ * Require.profile = prefix starts recording, to be written to
+ * <prefix>.json and <prefix>.folded when the state is closed; nil stops
+ * and discards what was recorded.
+ */
+static mrb_value
+mrb_require_s_set_profile(mrb_state *mrb, mrb_value self)
+{
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
+  mrb_value prefix;
+
+  mrb_get_args(mrb, "S!", &prefix);
+  free(st->profile);
+  st->profile = NULL;
+  if (mrb_nil_p(prefix)) {
+    profile_free(st);
+  } else {
+    st->profile = strdup(RSTRING_CSTR(mrb, prefix));
+  }
+  return prefix;
+}
+
+MRB_API const struct mrb_require_stats*
+mrb_require_stats(mrb_state *mrb)
+{
+  return require_stats(mrb);
+}
+
+static void
+stats_set(mrb_state *mrb, mrb_value hash, const char *key, uint64_t n)
+{
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_cstr(mrb, key)), mrb_fixnum_value((mrb_int)n));
+}
+
+/* Require.stats: the counters of mrb_require_stats() as a Hash. */
+static mrb_value
+mrb_require_s_stats(mrb_state *mrb, mrb_value self)
+{
+  const struct mrb_require_stats *stats = require_stats(mrb);
+  mrb_value hash = mrb_hash_new(mrb);
+  mrb_value phases = mrb_hash_new(mrb);
+  int i;
+
+  stats_set(mrb, hash, "requires", stats->requires);
+  stats_set(mrb, hash, "loads", stats->loads);
+  stats_set(mrb, hash, "already_loaded", stats->already_loaded);
+  stats_set(mrb, hash, "probes", stats->probes);
+  stats_set(mrb, hash, "realpath_ok", stats->realpath_ok);
+  stats_set(mrb, hash, "realpath_failed", stats->realpath_failed);
+  stats_set(mrb, hash, "open_ok", stats->open_ok);
+  stats_set(mrb, hash, "open_failed", stats->open_failed);
+  stats_set(mrb, hash, "source_bytes", stats->source_bytes);
+  stats_set(mrb, hash, "bytecode_bytes", stats->bytecode_bytes);
+  stats_set(mrb, hash, "shared_objects", stats->shared_objects);
+  for (i = 0; i < MRB_REQUIRE_PHASE_MAX; i++) {
+    stats_set(mrb, phases, phase_names[i], stats->phase_ns[i]);
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "phase_ns")), phases);
+  return hash;
+}
+
+/* Require.memory_report: what each loaded path took, see memory_end. */
+static mrb_value
+mrb_require_s_memory_report(mrb_state *mrb, mrb_value self)
+{
+  mrb_value report = mrb_iv_get(mrb, require_state_value(mrb), mrb_intern_lit(mrb, "memory"));
+
+  return mrb_hash_p(report) ? mrb_obj_dup(mrb, report) : mrb_hash_new(mrb);
+}
+
+/*
+ * Require.memory_report = true starts accounting for the loads that
+ * follow; false stops it and discards the report.
+ */
+static mrb_value
+mrb_require_s_set_memory_report(mrb_state *mrb, mrb_value self)
+{
+  mrb_value state = require_state_value(mrb);
+  struct require_state *st = (struct require_state *)DATA_PTR(state);
+  mrb_value on;
+
+  mrb_get_args(mrb, "o", &on);
+  st->memory_on = mrb_test(on);
+  if (!st->memory_on) {
+    mrb_iv_set(mrb, state, mrb_intern_lit(mrb, "memory"), mrb_nil_value());
+  }
+  return on;
+}
+
 void
 mrb_mruby_require_gem_init(mrb_state* mrb)
 {
   char *env;
   struct RClass *krn;
   struct RClass *load_error;
+  struct RClass *require;
   krn = mrb->kernel_module;
 
   mrb_define_method(mrb, krn, "load",    mrb_f_load,    MRB_ARGS_REQ(1));
@@ -618,11 +3351,20 @@ mrb_mruby_require_gem_init(mrb_state* mrb)
   load_error = mrb_define_class(mrb, "LoadError", E_SCRIPT_ERROR);
   mrb_define_method(mrb, load_error, "path", mrb_load_error_path, MRB_ARGS_NONE());
 
+  require = mrb_define_module(mrb, "Require");
+  mrb_define_class_method(mrb, require, "profile",  mrb_require_s_profile,     MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, require, "profile=", mrb_require_s_set_profile, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, require, "stats",    mrb_require_s_stats,       MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, require, "memory_report",  mrb_require_s_memory_report,     MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, require, "memory_report=", mrb_require_s_set_memory_report, MRB_ARGS_REQ(1));
+
+  mrb_gv_set(mrb, mrb_intern_lit(mrb, "$\"_state"), require_state_new(mrb));
   mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$:"), mrb_init_load_path(mrb));
   mrb_gv_set(mrb, mrb_intern_cstr(mrb, "$\""), mrb_ary_new(mrb));
 
   env = getenv("MRUBY_REQUIRE");
   if (env != NULL) {
+    mrb_value names = mrb_ary_new(mrb);
     int i, envlen;
     envlen = strlen(env);
     for (i = 0; i < envlen; i++) {
@@ -634,24 +3376,40 @@ mrb_mruby_require_gem_init(mrb_state* mrb)
       }
       len = end - ptr;
 
-      mrb_require(mrb, mrb_str_new(mrb, ptr, len));
+      mrb_ary_push(mrb, names, mrb_str_new(mrb, ptr, len));
       i += len;
     }
+
+#ifdef USE_PTHREAD
+    env = getenv("MRUBY_REQUIRE_PRELOAD_THREADS");
+    if (env != NULL && atoi(env) > 1) {
+      so_prefetch(mrb, names, atoi(env));
+    }
+#endif
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+      mrb_require(mrb, mrb_ary_entry(names, i));
+    }
   }
 }
 
 void
 mrb_mruby_require_gem_final(mrb_state* mrb)
 {
-  mrb_value loaded_files = mrb_gv_get(mrb, mrb_intern_cstr(mrb, "$\""));
+  struct require_state *st = (struct require_state *)DATA_PTR(require_state_value(mrb));
   int i;
-  for (i = 0; i < RARRAY_LEN(loaded_files); i++) {
-    mrb_value f = mrb_ary_entry(loaded_files, i);
-    const char* ext = strrchr(RSTRING_CSTR(mrb, f), '.');
-    if (ext && strcmp(ext, ".so") == 0) {
-      unload_so_file(mrb, f);
-    }
+
+  path_cache_write(mrb);
+  profile_write(st);
+  /* the state is freed after this, so its allocator must be back in place */
+  memory_unwind(st, mrb, NULL);
+
+  /* finalize in reverse load order, dependencies last */
+  for (i = st->nsos - 1; i >= 0; i--) {
+    unload_so_file(mrb, st->sos[i]);
   }
+  free(st->sos);
+  st->sos = NULL;
+  st->nsos = 0;
 }
 
 /* vim:set et ts=2 sts=2 sw=2 tw=0: */
@@ -0,0 +1,71 @@
+#!/usr/bin/env ruby
+#
+# Packs .rb/.mrb files into a mruby-require archive (.mra). Put the archive
+# itself on $: and `require` finds the features inside it.
+#
+#   ruby tools/mrbar.rb [-c] [-z] [--mrbc=PATH] -o lib.mra DIR...
+#
+#   -c  compile .rb files to bytecode with mrbc (stored as .mrb members)
+#   -z  deflate members (mruby-require must be built with zlib support)
+#
+require 'optparse'
+require 'tmpdir'
+require 'zlib'
+
+MAGIC = "MRBREQA1"
+DEFLATE = 1
+
+compile = false
+deflate = false
+mrbc = 'mrbc'
+output = nil
+OptionParser.new do |opts|
+  opts.banner = "usage: #{$0} [-c] [-z] [--mrbc=PATH] -o OUTPUT DIR..."
+  opts.on('-c', 'compile .rb files with mrbc') { compile = true }
+  opts.on('-z', 'deflate members') { deflate = true }
+  opts.on('--mrbc=PATH', 'mrbc command') {|v| mrbc = v }
+  opts.on('-o OUTPUT', 'archive to write') {|v| output = v }
+end.parse!
+abort "#{$0}: -o OUTPUT is required" unless output
+
+members = {}
+Dir.mktmpdir do |tmp|
+  ARGV.each do |dir|
+    Dir.glob('**/*.{rb,mrb}', base: dir).sort.each do |name|
+      path = File.join(dir, name)
+      if compile and name.end_with?('.rb')
+        mrb = File.join(tmp, "#{members.size}.mrb")
+        system(mrbc, '-g', '-o', mrb, path) or abort "#{$0}: mrbc failed for #{path}"
+        name = name.sub(/\.rb\z/, '.mrb')
+        path = mrb
+      end
+      data = File.binread(path)
+      members[name] = [name.end_with?('.mrb') ? 'm' : 'r', data]
+    end
+  end
+end
+
+index_size = 12 + members.keys.map {|name| 2 + name.bytesize + 14 }.sum
+offset = (index_size + 7) & ~7
+index = MAGIC + [members.size].pack('N')
+blobs = ''.b
+members.each do |name, (type, data)|
+  raw_size = data.bytesize
+  flags = 0
+  if deflate
+    data = Zlib::Deflate.deflate(data, Zlib::BEST_COMPRESSION)
+    flags |= DEFLATE
+  end
+  # keep member data 8-byte aligned so bytecode can be used in place
+  pad = (-(offset + blobs.bytesize)) & 7
+  blobs << "\0" * pad
+  index << [name.bytesize].pack('n') << name.b << type << flags.chr
+  index << [offset + blobs.bytesize, data.bytesize, raw_size].pack('NNN')
+  blobs << data
+end
+
+File.open(output, 'wb') do |f|
+  f.write index
+  f.write "\0" * (offset - index.bytesize)
+  f.write blobs
+end